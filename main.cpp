@@ -7,11 +7,51 @@
 #include <cmath>      // for std::isnan
 #include <algorithm>  // for std::sort
 #include <iomanip>    // for std::setprecision
+#include <map>
+#include <set>
+#include <array>
+#include <chrono>
+#include <cstdio>     // for std::sscanf
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <queue>
+#include <mutex>
+#include <memory>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#define NOMINMAX            // 不要讓 windows.h 的 min/max 巨集蓋掉 std::min / std::max
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>     // _BitScanForward64 / __popcnt64
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 using namespace std;
 
 // 初始資金（用來模擬 & 算報酬率）
 const double INITIAL = 10000.0;
 
+// short/long period 的上限（brute force 跑 1..MAXN x 1..MAXN）
+const int MAXN = 256;
+
 // 一天的資料：日期 + 多檔股票價格
 struct DayData {
     string date;
@@ -21,30 +61,225 @@ struct DayData {
 // 全域變數
 vector<string> g_symbols;    // 股票代號列表（從 header 讀）
 vector<DayData> g_data;      // 每天的所有股票資料
+vector<int> g_dateKeys;      // 跟 g_data 一一對應的日期 key（YYYYMMDD）
+vector<vector<unsigned long long>> g_valid;  // --gaps 非 drop：g_valid[k] 第 i 個 bit = 第 k 檔第 i 天有價格
+
+// grid 的實作方式（--engine）
+enum class GridEngine {
+    Scan,       // 每組各自完整模擬
+    Dedupe,     // 交叉事件序列相同的組合只模擬一次（單一情境時改用 scan，見 parseArgs）
+    BnB,        // 只要前 N 名時，用完美預知上限剪枝
+    Tiled,      // 組合 x 天數分塊，讓 SMA 片段留在 cache
+    Batched,    // day-major SMA，一天推進全部組合
+};
+
+// 均線種類（--indicator）
+enum class Indicator {
+    SMA,        // 簡單移動平均（原本的）
+    EMA,        // 指數移動平均
+    WMA,        // 線性加權移動平均
+};
+
+// 缺值的處理方式（--gaps）
+enum class GapPolicy {
+    Drop,       // 用到的欄位有一格壞掉就整天略過（原本的行為）
+    Skip,       // 每檔只看自己有效的日子
+    FFill,      // 沿用前一個有效價
+    Reset,      // 缺值之後 SMA 重新累積
+};
+
+// 每筆成交的交易成本（--fee / --fixed-fee / --slippage、--costs 的一個情境）
+//   買進用 price * (1 + slip) 成交、賣出用 price * (1 - slip)，
+//   另外收成交金額 * rate 與固定 fixed 元
+struct TradeCost {
+    double fixed = 0.0;
+    double rate = 0.0;
+    double slip = 0.0;
+
+    bool any() const { return fixed > 0 || rate > 0 || slip > 0; }
+};
+
+// 排名依據（--sort）；capital 以外的都需要 --metrics
+enum class SortKey {
+    Capital,    // 最終資金（原本的）
+    Drawdown,   // 最大回撤（小的在前）
+    Sharpe,     // Sharpe（大的在前）
+    Exposure,   // 持有比例（小的在前）
+    WinRate,    // 勝率（大的在前）
+    Trades,     // 交易次數（少的在前）
+};
+
+// 命令列參數（main 解析一次，其他地方直接讀）
+struct RunOptions {
+    string input = "multistocks.csv";   // --input：資料檔
+    string inputDir;                    // --input-dir：一檔 symbol 一個檔案（Date,Close）
+    string servePath;                   // --serve：daemon 模式的 socket 路徑
+    bool warmAll = false;               // --warm：daemon 啟動時先把所有 symbol 的 SMA 算好
+    string incrementalPath;             // --incremental：增量更新的 checkpoint 檔
+    vector<string> symbols = { "AAPL", "MMM", "KO", "V", "CAT" };  // --symbols
+    int fromKey = 20240101;             // --from / --year：模擬區間起點（日期 key）
+    int toKey = 20241231;               // --to / --year：模擬區間終點
+    int topN = 20;                      // --top：每檔輸出前幾名
+    string cacheDir;                    // --cache-dir：結果快取目錄（空字串 = 不用快取）
+    int threads = 0;                    // --threads：平行的 thread 數（0 = 全部核心）
+    bool walkForward = false;           // --walk-forward：walk-forward 模式
+    int trainMonths = 12;               // --train-months：walk-forward 訓練區間長度
+    int testMonths = 1;                 // --test-months：walk-forward 測試區間長度
+    vector<int> years;                  // --years：多區間模式，每年各出一份排名
+    GridEngine engine = GridEngine::Scan;   // --engine：grid 的實作方式
+    bool bench = false;                 // --bench：比較各 engine 的速度
+    int screenS = 0;                    // --screen s,l：全市場篩選（0 = 不篩選）
+    int screenL = 0;
+    int memBudgetMB = 0;                // --mem-budget：平行工作的記憶體預算（MB，0 = 不限制）
+    int shardIndex = 0;                 // --shard i/n：只跑第 i 份（1..n，0 = 不分片）
+    int shardCount = 0;
+    bool shardByCost = false;           // --shard-by cost：依估計成本分（預設依 symbol hash）
+    vector<string> mergeFiles;          // --merge：把分片檔合併成 sma_rank_all.csv
+    string coordinateDir;               // --coordinate：檔案佇列的 coordinator
+    string workerDir;                   // --worker：從檔案佇列領工作
+    int spawnWorkers = 0;               // --spawn：coordinator 在本機 fork 幾個 worker
+    int retries = 2;                    // --retries：失敗的工作最多重試幾次
+    int leaseSec = 600;                 // --lease-sec：工作領走多久沒完成就收回
+    string checkpointDir;               // --checkpoint：批次模式的 checkpoint 目錄
+    int checkpointRows = 32;            // --checkpoint-rows：每算幾個 s 存一次進度
+    bool stream = false;                // --stream：串流模式（不把整個檔讀進記憶體）
+    GapPolicy gaps = GapPolicy::Drop;   // --gaps：缺值的處理方式
+    Indicator indicator = Indicator::SMA;   // --indicator：均線種類
+    bool fillNextDay = false;           // --fill next：訊號隔天收盤成交
+    bool fractional = false;            // --fractional：可買零股
+    bool longShort = false;             // --long-short：死亡交叉時放空
+    TradeCost cost;                     // --fee / --fixed-fee / --slippage：交易成本
+    vector<TradeCost> costScenarios;    // --costs：同一次 grid 另外評估的成本情境
+    bool metrics = false;               // --metrics：同一次模擬另外算回撤 / Sharpe / 持有比例 / 勝率
+    SortKey sortKey = SortKey::Capital; // --sort：排名依據
+    vector<SortKey> paretoKeys;         // --pareto：Pareto front 的目標（空 = 不算）
+    bool resume = false;                // --resume：沿用 checkpoint，跳過已完成的部分
+};
+RunOptions g_opt;
+
+// --------------------------------------------------
+// 小工具：去掉前後空白 / 用逗號切一行 CSV（每個欄位都 trim）
+// --------------------------------------------------
+string trimField(const string& s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == string::npos) return "";
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+vector<string> splitCsvLine(const string& line) {
+    vector<string> tokens;
+    string token;
+    stringstream ss(line);
+    while (getline(ss, token, ',')) {
+        tokens.push_back(trimField(token));
+    }
+    return tokens;
+}
+
+// --------------------------------------------------
+// 小工具：日期字串 → 整數 key (YYYYMMDD)，方便比大小 / 二分搜尋
+//   支援 M/D/YYYY（檔案格式）、YYYY-MM-DD、YYYYMMDD、YYYY
+//   只給年份時：isEnd=false → 1/1，isEnd=true → 12/31
+//   失敗回傳 -1
+// --------------------------------------------------
+int parseDateKey(const string& s, bool isEnd = false) {
+    int y = 0, m = 0, d = 0;
+    if (s.find('/') != string::npos) {
+        if (sscanf(s.c_str(), "%d/%d/%d", &m, &d, &y) != 3) return -1;
+    }
+    else if (s.find('-') != string::npos) {
+        if (sscanf(s.c_str(), "%d-%d-%d", &y, &m, &d) != 3) return -1;
+    }
+    else if (s.size() == 8 && s.find_first_not_of("0123456789") == string::npos) {
+        int v = stoi(s);
+        y = v / 10000; m = v / 100 % 100; d = v % 100;
+    }
+    else if (s.size() == 4 && s.find_first_not_of("0123456789") == string::npos) {
+        y = stoi(s);
+        m = isEnd ? 12 : 1;
+        d = isEnd ? 31 : 1;
+    }
+    else {
+        return -1;
+    }
+    if (m < 1 || m > 12 || d < 1 || d > 31) return -1;
+    return y * 10000 + m * 100 + d;
+}
+
+// --------------------------------------------------
+// 小工具：把 [p, end) 這一欄轉成 double（規則同 stod：前面空白略過、
+//   後面多餘字元忽略、完全轉不出來或超出範圍算失敗）
+// --------------------------------------------------
+bool parsePriceField(const char* p, const char* end, double& v) {
+    while (p < end && isspace((unsigned char)*p)) ++p;
+    if (p == end) return false;
+    char* stop = nullptr;
+    errno = 0;
+    v = strtod(p, &stop);   // 遇到逗號 / 行尾自然停下
+    return stop != p && stop <= end && errno != ERANGE;
+}
+
+// --------------------------------------------------
+// 小工具：解析一行資料列，只轉換 cols（遞增的欄位 index）指定的欄位，
+//   其他欄位只跳過；最後一個要的欄位之後整行都不看。
+//   欄位數跟 header 不符、或用到的欄位轉換失敗 → 印出原因、回傳 false
+//   （loadFile / 增量 / 串流共用，略過規則一致）
+//   nanOnError：轉換失敗的格子存 NaN、整行照收（--gaps 非 drop）
+// --------------------------------------------------
+bool parseDataRow(const string& line, size_t headerFields, const vector<int>& cols,
+    string& date, vector<double>& prices, bool nanOnError = false)
+{
+    // 欄位數（跟 splitCsvLine 一樣：行尾的逗號後面不算一欄）
+    size_t fields = count(line.begin(), line.end(), ',') + 1;
+    if (!line.empty() && line.back() == ',') --fields;
+    if (fields != headerFields) {
+        cerr << "欄位數不符，略過此行: " << line << "\n";
+        return false;
+    }
+
+    prices.clear();
+    const char* fieldStart = line.c_str();
+    const char* lineEnd = fieldStart + line.size();
+    size_t next = 0;    // 下一個要讀的是 cols[next]
+    for (int col = 0; ; ++col) {
+        const char* comma = (const char*)memchr(fieldStart, ',', lineEnd - fieldStart);
+        const char* fieldEnd = comma ? comma : lineEnd;
+
+        if (col == 0) {
+            date = trimField(string(fieldStart, fieldEnd));
+        }
+        else if (col == cols[next]) {
+            double v;
+            if (!parsePriceField(fieldStart, fieldEnd, v)) {
+                if (!nanOnError) {
+                    cerr << "數值轉換失敗，略過此行: " << trimField(string(fieldStart, fieldEnd))
+                        << " (line: " << line << ")\n";
+                    return false;
+                }
+                v = numeric_limits<double>::quiet_NaN();
+            }
+            prices.push_back(v);
+            ++next;
+        }
+
+        if (!comma || next == cols.size()) break;   // 後面的欄位都用不到
+        fieldStart = comma + 1;
+    }
+    return true;
+}
 
 // --------------------------------------------------
 // loadFile：讀 multistocks.csv → 填 g_symbols, g_data
 //   假設格式：Date,AAPL,MSFT,... （第一欄是日期）
+//   projection 非空：只留這些 symbol 的欄位（g_symbols 依 header 順序），
+//   先從 header 找出欄位 index，其他欄位只跳過、不轉數值（parseDataRow）。
+//   ★ 壞掉的數值只有在「用到的欄位」才會讓整行被略過；沒投影時跟以前一樣，
+//     任何一欄壞掉都略過。所以投影後的日期可能比全讀時多幾天。
+//     --gaps 非 drop 時不略過，壞掉的格子存 NaN（見缺值處理）。
 // --------------------------------------------------
-bool loadFile(const string& filename)
+bool loadFile(const string& filename, const vector<string>& projection = {})
 {
-    auto trim = [](const string& s) -> string {
-        size_t start = s.find_first_not_of(" \t\r\n");
-        if (start == string::npos) return "";
-        size_t end = s.find_last_not_of(" \t\r\n");
-        return s.substr(start, end - start + 1);
-        };
-
-    auto splitByComma = [&](const string& line) -> vector<string> {
-        vector<string> tokens;
-        string token;
-        stringstream ss(line);
-        while (getline(ss, token, ',')) {
-            tokens.push_back(trim(token));
-        }
-        return tokens;
-        };
-
     ifstream fin(filename);
     if (!fin.is_open()) {
         cerr << "無法開啟檔案: " << filename << "\n";
@@ -53,6 +288,7 @@ bool loadFile(const string& filename)
 
     g_symbols.clear();
     g_data.clear();
+    g_dateKeys.clear();
 
     string line;
 
@@ -62,46 +298,33 @@ bool loadFile(const string& filename)
         return false;
     }
 
-    auto headerTokens = splitByComma(line);
+    auto headerTokens = splitCsvLine(line);
     if (headerTokens.size() < 2) {
         cerr << "header 欄位太少: " << line << "\n";
         return false;
     }
 
-    // headerTokens[0] = "Date"
+    // headerTokens[0] = "Date"；cols = 要讀的欄位 index（遞增）
+    vector<int> cols;
     for (size_t i = 1; i < headerTokens.size(); ++i) {
+        if (!projection.empty()
+            && find(projection.begin(), projection.end(), headerTokens[i]) == projection.end()) {
+            continue;
+        }
         g_symbols.push_back(headerTokens[i]);
+        cols.push_back((int)i);
     }
 
     // ========== 讀每天資料 ==========
     while (getline(fin, line)) {
         if (line.find_first_not_of(" \t\r\n") == string::npos) continue;
 
-        auto tokens = splitByComma(line);
-        if (tokens.size() != headerTokens.size()) {
-            cerr << "欄位數不符，略過此行: " << line << "\n";
-            continue;
-        }
-
         DayData day;
-        day.date = tokens[0];
-        day.prices.reserve(g_symbols.size());
-
-        bool ok = true;
-        for (size_t i = 1; i < tokens.size(); ++i) {
-            try {
-                double v = stod(tokens[i]);
-                day.prices.push_back(v);
-            }
-            catch (...) {
-                cerr << "數值轉換失敗，略過此行: " << tokens[i]
-                    << " (line: " << line << ")\n";
-                ok = false;
-                break;
-            }
-        }
-        if (!ok) continue;
+        day.prices.reserve(cols.size());
+        if (!parseDataRow(line, headerTokens.size(), cols, day.date, day.prices,
+            g_opt.gaps != GapPolicy::Drop)) continue;
 
+        g_dateKeys.push_back(parseDateKey(day.date));
         g_data.push_back(std::move(day));
     }
 
@@ -119,325 +342,4533 @@ int findSymbolIndex(const string& symbol) {
 }
 
 // --------------------------------------------------
-// 計算簡單移動平均 (SMA)：前 n-1 天為 NaN
+// 小工具：依日期 key 找出 [fromKey, toKey] 落在 g_data 的起訖 index
+//   dateKeys 跟 g_data 一一對應（遞增）；找不到回傳 false
 // --------------------------------------------------
-vector<double> calcSMA(const vector<double>& p, int n) {
-    int N = (int)p.size();
-    vector<double> sma(N, numeric_limits<double>::quiet_NaN());
-    if (n < 1 || n > N) return sma;
-
-    double sum = 0.0;
-    for (int i = 0; i < n; i++) sum += p[i];
-    sma[n - 1] = sum / n;
-
-    for (int i = n; i < N; i++) {
-        sum += p[i] - p[i - n];
-        sma[i] = sum / n;
-    }
-    return sma;
+bool findDateRange(const vector<int>& dateKeys, int fromKey, int toKey,
+    int& startIdx, int& endIdx)
+{
+    auto lo = lower_bound(dateKeys.begin(), dateKeys.end(), fromKey);
+    auto hi = upper_bound(dateKeys.begin(), dateKeys.end(), toKey);
+    if (lo >= hi) return false;
+    startIdx = (int)(lo - dateKeys.begin());
+    endIdx = (int)(hi - dateKeys.begin()) - 1;
+    return true;
 }
 
 // --------------------------------------------------
-// 模擬結果：最後資金 + 交易次數
+// 小工具：取出單一 symbol 的價格序列（跟 g_data 的天數一一對應）
 // --------------------------------------------------
-struct SimResult {
-    double finalCapital;
-    int tradeCount;
-};
+vector<double> extractPrices(int symIdx) {
+    vector<double> prices;
+    prices.reserve(g_data.size());
+    for (auto& d : g_data) {
+        prices.push_back(d.prices[symIdx]);
+    }
+    return prices;
+}
 
 // --------------------------------------------------
-// 模擬策略（只在指定 index 區間內交易）
-//   初始資金 10000，整股交易，區間最後一天強制平倉（也算 1 次交易）
-//   規則：第 i 天偵測交叉 → 第 i 天收盤價成交
+// 小工具：把 0..count-1 的工作分給多條 thread（--threads，0 = 全部核心）
+//   工作之間不能互相依賴；每條 thread 用 atomic 計數器搶下一個 index
 // --------------------------------------------------
-SimResult simulateWithCapitalRange(
-    const vector<double>& prices,
-    const vector<double>& smaS,
-    const vector<double>& smaL,
-    int startIdx,
-    int endIdx
-) {
-    double cash = INITIAL;
-    int shares = 0;
-    int trades = 0;
+int workerCount() {
+    int n = g_opt.threads > 0 ? g_opt.threads : (int)thread::hardware_concurrency();
+    return max(n, 1);
+}
 
-    int N = (int)prices.size();
-    if (N == 0) return { INITIAL, 0 };
-    if (startIdx < 0) startIdx = 0;
-    if (endIdx >= N)   endIdx = N - 1;
-    if (startIdx >= endIdx) return { INITIAL, 0 };
+// fn(index, worker)：worker 是 0..workerCount()-1，可以拿來選每條 thread 自己的資源
+//   maxWorkers > 0：最多只開這麼多條（記憶體預算用，見 admittedWorkers）
+void parallelForWorker(int count, const function<void(int, int)>& fn, int maxWorkers = 0) {
+    int nThreads = min(workerCount(), count);
+    if (maxWorkers > 0) nThreads = min(nThreads, maxWorkers);
+    if (nThreads <= 1) {
+        for (int i = 0; i < count; ++i) fn(i, 0);
+        return;
+    }
 
-    if (startIdx < 1) startIdx = 1;
+    atomic<int> next(0);
+    vector<thread> pool;
+    for (int t = 0; t < nThreads; ++t) {
+        pool.emplace_back([&, t]() {
+            for (int i = next++; i < count; i = next++) fn(i, t);
+        });
+    }
+    for (auto& th : pool) th.join();
+}
 
-    for (int i = startIdx; i <= endIdx; ++i) {
+void parallelFor(int count, const function<void(int)>& fn, int maxWorkers = 0) {
+    parallelForWorker(count, [&](int i, int) { fn(i); }, maxWorkers);
+}
 
-        double dPrev = smaS[i - 1] - smaL[i - 1];
-        double dNow = smaS[i] - smaL[i];
+// ==================================================
+// 多檔輸入（--input-dir <dir>）：一檔 symbol 一個 CSV（Date,Close），
+//   檔名（去掉 .csv）就是 symbol。各檔平行解析，日期轉成整數 key 後
+//   用 k-way merge（min-heap）合成跟 loadFile 一樣的 g_data / g_dateKeys。
+//   各檔日曆對不齊時，沒有那天的 symbol 記成缺值（NaN）：
+//   --gaps drop（預設）跟單檔一樣整天略過，其他 --gaps 策略則保留（見缺值處理）。
+//   同一檔裡日期沒排好會先排序，重複的日期留最後一筆。
+// ==================================================
+struct SymbolFile {
+    string symbol;
+    string path;
+    vector<int> keys;           // 日期 key（排好、不重複）
+    vector<string> dates;       // 原始日期字串
+    vector<double> close;
+    int skipped = 0;            // 格式錯誤而略過的列
+    int duplicates = 0;         // 重複日期（留最後一筆）
+    string error;
+};
 
-        if (std::isnan(dPrev) || std::isnan(dNow)) continue;
+void readSymbolFile(SymbolFile& f, bool nanOnError) {
+    ifstream fin(f.path);
+    if (!fin.is_open()) {
+        f.error = "無法開啟檔案: " + f.path;
+        return;
+    }
+
+    string line;
+    if (!getline(fin, line)) {
+        f.error = "檔案是空的: " + f.path;
+        return;
+    }
+    if (line.compare(0, 3, "\xEF\xBB\xBF") == 0) line.erase(0, 3);
+    auto header = splitCsvLine(line);
 
-        // =============================
-        // ★★ 新增：如果是第一天（i == startIdx），禁止 BUY （無視黃金交叉）
-        // =============================
-        bool isFirstDay = (i == startIdx);
+    // 收盤價欄位：名稱是 Close（不分大小寫），只有兩欄時就用第二欄
+    int closeCol = -1;
+    for (size_t c = 1; c < header.size(); ++c) {
+        string name = header[c];
+        for (auto& ch : name) ch = (char)tolower((unsigned char)ch);
+        if (name == "close") closeCol = (int)c;
+    }
+    if (closeCol < 0 && header.size() == 2) closeCol = 1;
+    if (closeCol < 0) {
+        f.error = "找不到 Close 欄位: " + f.path;
+        return;
+    }
 
-        // BUY：黃金交叉
-        if (!isFirstDay && shares == 0 && dPrev < 0 && dNow > 0) {
-            int buyShares = (int)(cash / prices[i]);
-            if (buyShares > 0) {
-                shares += buyShares;
-                cash -= (double)buyShares * prices[i];
-                trades++;
+    while (getline(fin, line)) {
+        if (line.find_first_not_of(" \t\r\n") == string::npos) continue;
+        auto tokens = splitCsvLine(line);
+        int key = tokens.size() == header.size() ? parseDateKey(tokens[0]) : -1;
+        if (key < 0) {
+            f.skipped++;
+            continue;
+        }
+        const string& cell = tokens[closeCol];
+        double v;
+        if (!parsePriceField(cell.c_str(), cell.c_str() + cell.size(), v)) {
+            if (!nanOnError) {
+                f.skipped++;
+                continue;
             }
+            v = numeric_limits<double>::quiet_NaN();
         }
-        // SELL：死亡交叉
-        else if (shares > 0 && dPrev > 0 && dNow < 0) {
-            cash += (double)shares * prices[i];
-            shares = 0;
-            trades++;
+        f.keys.push_back(key);
+        f.dates.push_back(tokens[0]);
+        f.close.push_back(v);
+    }
+
+    // 依日期排序（穩定：同一天的原本順序不變），重複的日期留最後一筆
+    const int n = (int)f.keys.size();
+    vector<int> order(n);
+    for (int i = 0; i < n; ++i) order[i] = i;
+    if (!is_sorted(f.keys.begin(), f.keys.end())) {
+        stable_sort(order.begin(), order.end(), [&](int a, int b) { return f.keys[a] < f.keys[b]; });
+    }
+    vector<int> keys;
+    vector<string> dates;
+    vector<double> close;
+    for (int j = 0; j < n; ++j) {
+        int i = order[j];
+        if (!keys.empty() && keys.back() == f.keys[i]) {
+            f.duplicates++;
+            dates.back() = f.dates[i];
+            close.back() = f.close[i];
+            continue;
         }
+        keys.push_back(f.keys[i]);
+        dates.push_back(f.dates[i]);
+        close.push_back(f.close[i]);
     }
+    f.keys.swap(keys);
+    f.dates.swap(dates);
+    f.close.swap(close);
+}
 
-    // 區間最後一天強制平倉
-    if (shares > 0) {
-        cash += (double)shares * prices[endIdx];
-        shares = 0;
-        trades++;
+bool loadDirectory(const string& dir, const vector<string>& projection = {}) {
+    g_symbols.clear();
+    g_data.clear();
+    g_dateKeys.clear();
+
+    vector<SymbolFile> files;
+    error_code ec;
+    for (filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!it->is_regular_file() || it->path().extension() != ".csv") continue;
+        SymbolFile f;
+        f.symbol = it->path().stem().string();
+        f.path = it->path().string();
+        if (!projection.empty() && find(projection.begin(), projection.end(), f.symbol) == projection.end()) {
+            continue;
+        }
+        files.push_back(std::move(f));
+    }
+    if (ec) {
+        cerr << "無法讀取目錄: " << dir << "\n";
+        return false;
+    }
+    sort(files.begin(), files.end(), [](const SymbolFile& a, const SymbolFile& b) { return a.symbol < b.symbol; });
+
+    const bool nanOnError = (g_opt.gaps != GapPolicy::Drop);
+    parallelFor((int)files.size(), [&](int k) { readSymbolFile(files[k], nanOnError); });
+
+    // 錯誤 / 警告統一在這裡依序印（不要讓各 thread 的訊息混在一起）
+    vector<SymbolFile*> ok;
+    for (auto& f : files) {
+        if (!f.error.empty()) {
+            cerr << f.error << "\n";
+            continue;
+        }
+        if (f.skipped > 0) cerr << f.symbol << "：略過 " << f.skipped << " 列格式錯誤的資料\n";
+        if (f.duplicates > 0) cerr << f.symbol << "：" << f.duplicates << " 個重複日期，保留最後一筆\n";
+        g_symbols.push_back(f.symbol);
+        ok.push_back(&f);
+    }
+    if (ok.empty()) {
+        cerr << "目錄裡沒有可用的 symbol 檔案: " << dir << "\n";
+        return false;
+    }
+
+    // k-way merge：heap 裡放每檔下一筆的 (日期 key, 第幾檔)
+    const int K = (int)ok.size();
+    vector<size_t> pos(K, 0);
+    priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> heap;
+    for (int k = 0; k < K; ++k) {
+        if (!ok[k]->keys.empty()) heap.push({ ok[k]->keys[0], k });
+    }
+
+    int dropped = 0;
+    while (!heap.empty()) {
+        const int key = heap.top().first;
+        DayData day;
+        day.prices.assign(K, numeric_limits<double>::quiet_NaN());
+        bool complete = true;
+
+        while (!heap.empty() && heap.top().first == key) {
+            int k = heap.top().second;
+            heap.pop();
+            if (day.date.empty()) day.date = ok[k]->dates[pos[k]];   // 日期字串用編號最小的那檔
+            day.prices[k] = ok[k]->close[pos[k]];
+            if (++pos[k] < ok[k]->keys.size()) heap.push({ ok[k]->keys[pos[k]], k });
+        }
+        for (double v : day.prices) complete = complete && !std::isnan(v);
+
+        // drop：跟單檔一樣，有一檔沒有價格就整天略過
+        if (!complete && g_opt.gaps == GapPolicy::Drop) {
+            dropped++;
+            continue;
+        }
+        g_dateKeys.push_back(key);
+        g_data.push_back(std::move(day));
     }
 
-    return { cash, trades };
+    cout << "讀入 " << K << " 個檔案，合併後 " << g_data.size() << " 天";
+    if (dropped > 0) cout << "（日曆不一致略過 " << dropped << " 天，可用 --gaps 保留）";
+    cout << "\n";
+    return true;
 }
 
 // --------------------------------------------------
-// 每一組 short/long 的結果，用來排序 & 輸出
+// 小工具：FNV-1a 64 位元雜湊（結果快取 key、交叉事件去重）
 // --------------------------------------------------
-struct BruteResult {
-    int s;
-    int l;
-    double finalCapital;
-    int trades;
+struct Fnv64 {
+    unsigned long long h = 1469598103934665603ULL;
+    void add(const void* data, size_t len) {
+        const unsigned char* p = (const unsigned char*)data;
+        for (size_t i = 0; i < len; ++i) {
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+    }
+    void add(const string& s) { add(s.data(), s.size() + 1); }  // 含結尾 0，避免串接混淆
+    template <typename T>
+    void addPod(const T& v) { add(&v, sizeof(T)); }
 };
 
 // --------------------------------------------------
-// 對單一 symbol：brute force 並把前 topN 名 append 到同一個 CSV
-//   檔案格式（整檔）：
-//   排名,短期,長期,最終獲利,報酬率,交易次數
-//   AAPL 的 20 筆
-//   空行
-//   MMM,,,,,
-//   MMM 的 20 筆
-//   空行
-//   KO,,,,,
-//   ...
-//   ★ 金額 & 報酬率用雙引號包起來，讓 Excel 當文字，不會吃精度。
+// 計算簡單移動平均 (SMA)：前 n-1 天為 NaN
+//   calcSMAInto 寫進呼叫端給的記憶體（arena 用），calcSMA 回傳 vector
 // --------------------------------------------------
-void bruteForceAndAppend(
-    const vector<double>& prices,
-    int startIdx,
-    int endIdx,
-    const string& label,
-    ofstream& fout,
-    bool isFirstSymbol,
-    int topN = 20
-) {
-    const int MAXN = 256;
-    int N = (int)prices.size();
+void calcSMAInto(const double* p, int N, int n, double* sma) {
+    fill(sma, sma + N, numeric_limits<double>::quiet_NaN());
+    if (n < 1 || n > N) return;
 
-    // 預先把所有 period 的 SMA 算好
-    vector<vector<double>> allSMA(MAXN + 1);
-    for (int n = 1; n <= MAXN; n++) {
-        allSMA[n] = calcSMA(prices, n);
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) sum += p[i];
+    sma[n - 1] = sum / n;
+
+    for (int i = n; i < N; i++) {
+        sum += p[i] - p[i - n];
+        sma[i] = sum / n;
     }
+}
 
-    double bestCapital = -1e18;
-    int bestS = -1, bestL = -1;
+vector<double> calcSMA(const vector<double>& p, int n) {
+    int N = (int)p.size();
+    vector<double> sma(N);
+    calcSMAInto(p.data(), N, n, sma.data());
+    return sma;
+}
 
-    vector<BruteResult> results;
-    results.reserve(MAXN * MAXN);
+// --------------------------------------------------
+// 其他均線（--indicator ema|wma）：前 n-1 天同樣是 NaN，交叉規則、引擎都不變
+//   EMA(n)：第 n-1 天用前 n 天的 SMA 起頭，之後 e += α (p - e)，α = 2 / (n + 1)
+//   WMA(n)：權重 1..n（最新一天權重 n），用兩個滾動總和 O(1) 更新：
+//     加權和 W += n * p[i] - S（S 是上一個視窗的簡單總和），再更新 S
+//     （不用全域 prefix sum：天數多的時候 Σ i*p 會很大，相減會吃掉精度）
+// --------------------------------------------------
+const char* indicatorName(Indicator ind) {
+    switch (ind) {
+    case Indicator::EMA: return "ema";
+    case Indicator::WMA: return "wma";
+    default: return "sma";
+    }
+}
 
-    // 算出所有組合
-    for (int s = 1; s <= MAXN; s++) {
-        for (int l = 1; l <= MAXN; l++) {
-            SimResult sr = simulateWithCapitalRange(
-                prices, allSMA[s], allSMA[l],
-                startIdx, endIdx
-            );
-            results.push_back({ s, l, sr.finalCapital, sr.tradeCount });
+void calcEMAInto(const double* p, int N, int n, double* out) {
+    fill(out, out + N, numeric_limits<double>::quiet_NaN());
+    if (n < 1 || n > N) return;
 
-            if (sr.finalCapital > bestCapital) {
-                bestCapital = sr.finalCapital;
-                bestS = s;
-                bestL = l;
-            }
-        }
-    }
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) sum += p[i];
+    double e = sum / n;
+    out[n - 1] = e;
 
-    // Console 上顯示一下這檔的最佳組合
-    cout << "\n==== " << label << " ====\n";
-    cout << "最佳組合： short=" << bestS
-        << " long=" << bestL
-        << " final_capital=" << bestCapital << "\n";
+    const double alpha = 2.0 / (n + 1);
+    for (int i = n; i < N; i++) {
+        e += alpha * (p[i] - e);
+        out[i] = e;
+    }
+}
 
-    // 排序：依 finalCapital 由大到小
-    sort(results.begin(), results.end(),
-        [](const BruteResult& a, const BruteResult& b) {
-            if (a.finalCapital != b.finalCapital)
-                return a.finalCapital > b.finalCapital;   // 資金多的在前
-
-            int da = std::abs(a.s - a.l);
-            int db = std::abs(b.s - b.l);
-            if (da != db)
-                return da > db;                            // 距離短的在前
-
-            if (a.s != b.s)
-                return a.s < b.s;                          // 再用 s 當第三鍵
-            return a.l < b.l;                              // 最後用 l
-        });
+void calcWMAInto(const double* p, int N, int n, double* out) {
+    fill(out, out + N, numeric_limits<double>::quiet_NaN());
+    if (n < 1 || n > N) return;
 
-    // Console 印出前 topN 名
-    cout << "\n排名\t短期\t長期\t最終獲利\t報酬率\t交易次數\n";
-    cout << fixed << setprecision(4);
-    for (int i = 0; i < topN && i < (int)results.size(); ++i) {
-        const auto& r = results[i];
-        double ret = (r.finalCapital / INITIAL - 1.0) * 100.0;
-        cout << (i + 1) << "\t"
-            << r.s << "\t"
-            << r.l << "\t"
-            << r.finalCapital << "\t"
-            << ret << "\t"
-            << r.trades << "\n";
+    const double denom = n * (n + 1) / 2.0;
+    double sum = 0.0, wsum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += p[i];
+        wsum += (double)(i + 1) * p[i];
     }
+    out[n - 1] = wsum / denom;
 
-    // ===== 寫進同一個 CSV 檔 =====
-    // 第一檔（例如 AAPL）就直接寫排名資料；
-    // 之後的 MMM/KO/V/CAT 先插一行「MMM,,,,,」，再空一行，再寫排名。
-    if (!isFirstSymbol) {
-        fout << label << ",,,,,\n\n";  // 分段標題 + 空白行
+    for (int i = n; i < N; i++) {
+        wsum += (double)n * p[i] - sum;
+        sum += p[i] - p[i - n];
+        out[i] = wsum / denom;
     }
+}
 
-    // 這邊用文字輸出：把數值包在雙引號裡
-    for (int i = 0; i < topN && i < (int)results.size(); ++i) {
-        const auto& r = results[i];
-        double ret = (r.finalCapital / INITIAL - 1.0) * 100.0;
+// 依 --indicator 算單一 period 的均線
+void calcLineInto(const double* p, int N, int n, double* out) {
+    switch (g_opt.indicator) {
+    case Indicator::EMA: calcEMAInto(p, N, n, out); break;
+    case Indicator::WMA: calcWMAInto(p, N, n, out); break;
+    default: calcSMAInto(p, N, n, out); break;
+    }
+}
 
-        std::ostringstream capSs;
-        capSs << std::fixed << std::setprecision(30) << r.finalCapital;
-        std::string capStr = capSs.str();
+// --------------------------------------------------
+// 所有 period 的均線：rows[n] 指向第 n 條線（長度 N），n = 1..maxN
+//   SMA 照原本逐 period 呼叫 calcSMAInto（數值不變）；
+//   EMA / WMA 一次掃過資料：每天把所有 period 的狀態一起往前推，
+//   依 n 跟 i 的關係分成「已穩定 / 剛好湊滿 / 還在累積」三段連續迴圈，
+//   每段都沒有分支，編譯器可以向量化。運算順序跟 calcEMAInto / calcWMAInto 相同。
+//   scratch：EMA / WMA 的工作區，lineScratchSize(maxN) 個 double（呼叫端給，
+//   批次模式從 worker 的 arena 拿，不向 heap 配置；SMA 用不到，可以是 nullptr）
+// --------------------------------------------------
+size_t lineScratchSize(int maxN = MAXN) { return 3 * (size_t)(maxN + 1); }
+
+void calcAllLinesInto(const double* p, int N, double* const* rows, double* scratch, int maxN = MAXN) {
+    if (g_opt.indicator == Indicator::SMA) {
+        for (int n = 1; n <= maxN; n++) calcSMAInto(p, N, n, rows[n]);
+        return;
+    }
+
+    const bool ema = (g_opt.indicator == Indicator::EMA);
+    const double NaN = numeric_limits<double>::quiet_NaN();
+    fill(scratch, scratch + lineScratchSize(maxN), 0.0);
+    double* sum = scratch;
+    double* acc = scratch + (maxN + 1);         // EMA：目前的 e；WMA：加權和
+    double* coef = scratch + 2 * (maxN + 1);    // EMA：α；WMA：權重總和 n(n+1)/2
+    for (int n = 1; n <= maxN; n++) coef[n] = ema ? 2.0 / (n + 1) : n * (n + 1) / 2.0;
+
+    for (int i = 0; i < N; ++i) {
+        const double x = p[i];
+
+        // n <= i：視窗已經滿了
+        const int steady = min(i, maxN);
+        if (ema) {
+            for (int n = 1; n <= steady; n++) {
+                acc[n] += coef[n] * (x - acc[n]);
+                rows[n][i] = acc[n];
+            }
+        }
+        else {
+            for (int n = 1; n <= steady; n++) {
+                acc[n] += (double)n * x - sum[n];
+                sum[n] += x - p[i - n];
+                rows[n][i] = acc[n] / coef[n];
+            }
+        }
+
+        // n == i + 1：今天剛好湊滿 n 天
+        if (i + 1 <= maxN) {
+            const int n = i + 1;
+            sum[n] += x;
+            if (ema) acc[n] = sum[n] / n;
+            else acc[n] += (double)(i + 1) * x;
+            rows[n][i] = ema ? acc[n] : acc[n] / coef[n];
+        }
+
+        // n > i + 1：還在累積
+        for (int n = i + 2; n <= maxN; n++) {
+            sum[n] += x;
+            if (!ema) acc[n] += (double)(i + 1) * x;
+            rows[n][i] = NaN;
+        }
+    }
+}
+
+// --------------------------------------------------
+// 橫截面 SMA：一次算出「某個 period、所有 symbol」的 SMA
+//   g_data 本來就是一天一列、所有 symbol 的價格連續放在 DayData::prices；
+//   先把要的欄位抄成連續的 [day][k] 矩陣（gatherCrossSection），
+//   滾動總和也用一個連續陣列（一個 symbol 一格），每天一次向量加減就更新全部。
+//   回傳 [day * W + k]；加減順序同 calcSMA，數值逐位元相同。
+// --------------------------------------------------
+vector<double> gatherCrossSection(const vector<int>& cols) {
+    const int N = (int)g_data.size();
+    const int W = (int)cols.size();
+    vector<double> px((size_t)N * W);
+    for (int i = 0; i < N; ++i) {
+        const double* row = g_data[i].prices.data();
+        for (int k = 0; k < W; ++k) px[(size_t)i * W + k] = row[cols[k]];
+    }
+    return px;
+}
+
+vector<double> calcSMACrossSectional(const vector<double>& px, int W, int n) {
+    const int N = W > 0 ? (int)(px.size() / W) : 0;
+    vector<double> sma((size_t)N * W, numeric_limits<double>::quiet_NaN());
+    if (n < 1 || n > N || W == 0) return sma;
+
+    vector<double> sum(W, 0.0);
+    for (int i = 0; i < n; i++) {
+        const double* p = &px[(size_t)i * W];
+        for (int k = 0; k < W; ++k) sum[k] += p[k];
+    }
+    for (int k = 0; k < W; ++k) sma[(size_t)(n - 1) * W + k] = sum[k] / n;
+
+    for (int i = n; i < N; i++) {
+        const double* pNew = &px[(size_t)i * W];
+        const double* pOld = &px[(size_t)(i - n) * W];
+        double* out = &sma[(size_t)i * W];
+        for (int k = 0; k < W; ++k) {
+            sum[k] += pNew[k] - pOld[k];
+            out[k] = sum[k] / n;
+        }
+    }
+    return sma;
+}
+
+// ==================================================
+// 缺值處理（--gaps drop|skip|ffill|reset）
+//   drop（預設）：跟以前一樣，用到的欄位有一格壞掉就整天略過（所有 symbol 一起少一天）
+//   其他：loadFile 保留整天，壞掉 / 空白的格子存 NaN，每檔另建一個有效位元圖
+//   （g_valid[k]，第 i 天在 bit i），批次模式依策略處理：
+//     skip ：這檔只看有效的日子（缺的那天當作不存在，SMA 用前 n 個有效價）
+//     ffill：缺的那天沿用前一個有效價（開頭就缺的那段略過）
+//     reset：缺值之後 SMA 重新累積，要再連續 n 天有效才有 SMA(n)
+//   區間起點往後、終點往前對到有效的日子（最後一天強制平倉要有價格）。
+//   位元圖用 ctz 一次跳過整段有效 / 無效的日子，沒缺值的檔幾乎不花時間。
+// ==================================================
+const char* gapPolicyName(GapPolicy g) {
+    switch (g) {
+    case GapPolicy::Skip: return "skip";
+    case GapPolicy::FFill: return "ffill";
+    case GapPolicy::Reset: return "reset";
+    default: return "drop";
+    }
+}
+
+inline int ctz64(unsigned long long x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+inline int popcount64(unsigned long long x) {
+#ifdef _MSC_VER
+    return (int)__popcnt64(x);
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+// 從 pos 開始找下一個 bit 等於 want 的日子；找不到回傳 N
+int nextMaskBit(const vector<unsigned long long>& mask, int N, int pos, bool want) {
+    while (pos < N) {
+        size_t w = (size_t)pos >> 6;
+        unsigned long long word = want ? mask[w] : ~mask[w];
+        word &= ~0ULL << (pos & 63);
+        if (word) return min((int)(w * 64) + ctz64(word), N);
+        pos = (int)(w + 1) * 64;
+    }
+    return N;
+}
+
+// [0, i) 裡有效的天數
+int countValidBefore(const vector<unsigned long long>& mask, int i) {
+    int c = 0;
+    for (int w = 0; w < (i >> 6); ++w) c += popcount64(mask[w]);
+    if (i & 63) c += popcount64(mask[i >> 6] & ((1ULL << (i & 63)) - 1));
+    return c;
+}
+
+// 依 g_data 建每檔的有效位元圖，回傳缺值格數
+long long buildValidMasks() {
+    const int N = (int)g_data.size();
+    const size_t K = g_symbols.size();
+    g_valid.assign(K, vector<unsigned long long>(((size_t)N + 63) / 64, 0));
+    long long missing = 0;
+    for (int i = 0; i < N; ++i) {
+        const double* row = g_data[i].prices.data();
+        for (size_t k = 0; k < K; ++k) {
+            if (std::isnan(row[k])) ++missing;
+            else g_valid[k][(size_t)i >> 6] |= 1ULL << (i & 63);
+        }
+    }
+    return missing;
+}
+
+// reset 策略的均線：每一段連續有效的日子各自從頭累積（段內算法同 calcLineInto）
+void calcLineResetInto(const double* p, const vector<unsigned long long>& mask, int N, int n, double* sma) {
+    fill(sma, sma + N, numeric_limits<double>::quiet_NaN());
+    for (int a = nextMaskBit(mask, N, 0, true); a < N; ) {
+        int b = nextMaskBit(mask, N, a, false);
+        calcLineInto(p + a, b - a, n, sma + a);
+        a = nextMaskBit(mask, N, b, true);
+    }
+}
+
+vector<vector<double>> calcAllLinesReset(const vector<double>& prices, const vector<unsigned long long>& mask) {
+    const int N = (int)prices.size();
+    vector<vector<double>> allSMA(MAXN + 1);
+    for (int n = 1; n <= MAXN; n++) {
+        allSMA[n].resize(N);
+        calcLineResetInto(prices.data(), mask, N, n, allSMA[n].data());
+    }
+    return allSMA;
+}
+
+// --------------------------------------------------
+// 依 --gaps 整理一檔的價格序列（in-place），並把區間 [startIdx, endIdx]
+// 換成整理後序列的 index。回傳整理後的長度；區間內沒有有效價格回傳 0
+// --------------------------------------------------
+int applyGapPolicy(int symIdx, double* prices, int N, int& startIdx, int& endIdx) {
+    const auto& mask = g_valid[symIdx];
+
+    if (g_opt.gaps == GapPolicy::Skip) {
+        // 有效的日子往前擠；區間 = 原區間裡的有效日子
+        int first = countValidBefore(mask, startIdx);
+        int last = countValidBefore(mask, endIdx + 1) - 1;
+        int k = 0;
+        for (int a = nextMaskBit(mask, N, 0, true); a < N; ) {
+            int b = nextMaskBit(mask, N, a, false);
+            if (k != a) memmove(prices + k, prices + a, sizeof(double) * (b - a));
+            k += b - a;
+            a = nextMaskBit(mask, N, b, true);
+        }
+        if (first > last) return 0;
+        startIdx = first;
+        endIdx = last;
+        return k;
+    }
+
+    if (g_opt.gaps == GapPolicy::FFill) {
+        int lead = nextMaskBit(mask, N, 0, true);   // 開頭就缺的天數
+        for (int a = nextMaskBit(mask, N, lead, false); a < N; ) {
+            int b = nextMaskBit(mask, N, a, true);
+            fill(prices + a, prices + b, prices[a - 1]);
+            a = nextMaskBit(mask, N, b, false);
+        }
+        if (lead > 0 && lead < N) memmove(prices, prices + lead, sizeof(double) * (N - lead));
+        startIdx = max(startIdx - lead, 0);
+        endIdx -= lead;
+        return endIdx < startIdx ? 0 : N - lead;
+    }
+
+    if (g_opt.gaps == GapPolicy::Reset) {
+        // 序列不動，起點往後、終點往前對到有效的日子
+        int first = nextMaskBit(mask, N, startIdx, true);
+        int last = endIdx;
+        while (last >= first && !((mask[(size_t)last >> 6] >> (last & 63)) & 1)) --last;
+        if (first > last) return 0;
+        startIdx = first;
+        endIdx = last;
+    }
+    return N;
+}
+
+// --------------------------------------------------
+// 風險指標（--metrics，跟資金在同一次模擬裡算；沒開時都是 0）
+//   淨值 = 每天收盤的現金 + 持股市值（最後一天用強制平倉後的現金）
+// --------------------------------------------------
+struct SimMetrics {
+    double maxDrawdown = 0.0;   // 最大回撤（%，淨值從前高往下掉最多的比例）
+    double sharpe = 0.0;        // 日報酬的 Sharpe（年化：* sqrt(252)，無風險利率當 0）
+    double exposure = 0.0;      // 持有比例（%，收盤時有部位的天數 / 區間天數）
+    double winRate = 0.0;       // 勝率（%，賺錢的平倉次數 / 平倉次數）
+};
+
+// --------------------------------------------------
+// 模擬結果：最後資金 + 交易次數（+ 風險指標）
+// --------------------------------------------------
+struct SimResult {
+    double finalCapital;
+    int tradeCount;
+    SimMetrics metrics = {};
+};
+
+// 交叉事件的類型（--engine dedupe 把事件編碼成 day*2 + 類型）
+const int EVENT_GOLDEN = 0;
+const int EVENT_DEATH = 1;
+
+// --------------------------------------------------
+// 策略規則（編譯期 policy）
+//   預設：第 i 天偵測交叉 → 第 i 天收盤價成交、整股、只做多、不計手續費
+//   --fill next    第 i 天的訊號用第 i+1 天收盤價成交（區間最後一天的訊號不成交）
+//   --fractional   可買零股（全部現金換成股票）
+//   --long-short   死亡交叉時平多單後放空，黃金交叉時回補後做多（不考慮保證金）
+//   --fee / --fixed-fee / --slippage   每筆成交的交易成本（TradeCost）
+//   --metrics      每天記淨值，順便算 SimMetrics（沒開時完全不記）
+//   每種組合各自編譯成一個沒有規則分支的 kernel，開始前選一次（selectSimKernels）
+//   只支援預設規則的路徑（bnb / tiled / batched / --screen / --years / 增量、串流）
+//   也都用 SimBook<DefaultRules> 成交，買賣規則只寫在 SimBook 這一份
+// --------------------------------------------------
+template <bool NextDayFill, bool Fractional, bool LongShort, bool Costs, bool Metrics>
+struct StrategyRules {
+    static constexpr bool nextDayFill = NextDayFill;
+    static constexpr bool fractional = Fractional;
+    static constexpr bool longShort = LongShort;
+    static constexpr bool costs = Costs;
+    static constexpr bool metrics = Metrics;
+    using Qty = conditional_t<Fractional, double, int>;   // 持股數的型別
+};
+using DefaultRules = StrategyRules<false, false, false, false, false>;
+const TradeCost NO_COST = {};   // 預設規則不計交易成本（DefaultRules 的 kernel 不會讀它）
+
+// 第 i 天的交叉訊號：+1 黃金交叉、-1 死亡交叉、0 沒有（有 NaN 時比較都不成立，也是 0）
+//   dPrev / dNow 是前一天 / 當天的 smaS - smaL
+inline int crossSignal(double dPrev, double dNow) {
+    if (dPrev < 0 && dNow > 0) return +1;
+    if (dPrev > 0 && dNow < 0) return -1;
+    return 0;
+}
+
+// 一組 (s,l) 的帳戶：qty > 0 持有多單，< 0 持有空單
+template <class Rules>
+struct SimBook {
+    double cash = INITIAL;
+    typename Rules::Qty qty = 0;
+    int trades = 0;
+
+    // --metrics 用的累計值（Rules::metrics 為 false 時不會碰到）
+    double entryCash = 0.0;     // 開倉前的現金（平倉後比較輸贏）
+    int closed = 0, wins = 0;
+    int days = 0, inMarket = 0;
+    double peak = INITIAL, prevEq = INITIAL, maxDD = 0.0;
+    double retSum = 0.0, retSq = 0.0;
+    int retCount = 0;
+    double pendingEq = 0.0;     // 最後一天的淨值先留著，強制平倉後換成平倉後的現金
+    bool hasPending = false;
+
+    // 成交價：買進（做多、回補）加滑價，賣出（平多、放空）減滑價
+    static double fillPrice(bool buy, double price, const TradeCost& c) {
+        if constexpr (Rules::costs) return buy ? price * (1.0 + c.slip) : price * (1.0 - c.slip);
+        else return price;
+    }
+
+    // 用全部現金開倉（dir = +1 做多，-1 放空）
+    void open(int dir, double price, const TradeCost& c) {
+        const double fill = fillPrice(dir > 0, price, c);
+        typename Rules::Qty q;
+        if constexpr (Rules::costs) {
+            double budget = (cash - c.fixed) / (fill * (1.0 + c.rate));
+            if constexpr (Rules::fractional) q = budget;
+            else q = (int)budget;
+        }
+        else {
+            if constexpr (Rules::fractional) q = cash / fill;
+            else q = (int)(cash / fill);
+        }
+        if (q > 0) {
+            if constexpr (Rules::metrics) entryCash = cash;
+            double amount = (double)q * fill;
+            if (dir > 0) {
+                qty += q;
+                cash -= amount;
+            }
+            else {
+                qty -= q;
+                cash += amount;
+            }
+            if constexpr (Rules::costs) cash -= amount * c.rate + c.fixed;
+            trades++;
+        }
+    }
+
+    // 平掉目前的部位（空單是買回）
+    void close(double price, const TradeCost& c) {
+        const double fill = fillPrice(qty < 0, price, c);
+        cash += (double)qty * fill;
+        if constexpr (Rules::costs) cash -= std::abs((double)qty) * fill * c.rate + c.fixed;
+        qty = 0;
+        trades++;
+        if constexpr (Rules::metrics) {
+            closed++;
+            if (cash > entryCash) wins++;
+        }
+    }
+
+    // 一天的淨值進帳：日報酬、前高、回撤
+    void commitEquity(double eq) {
+        double ret = eq / prevEq - 1.0;
+        retSum += ret;
+        retSq += ret * ret;
+        retCount++;
+        prevEq = eq;
+        if (eq > peak) peak = eq;
+        else maxDD = max(maxDD, (peak - eq) / peak);
+    }
+
+    // 收盤記一次淨值（缺值的日子跳過）
+    void mark(double price) {
+        if (std::isnan(price)) return;
+        if (hasPending) commitEquity(pendingEq);
+        pendingEq = cash + (double)qty * price;
+        hasPending = true;
+        days++;
+        if (qty != 0) inMarket++;
+    }
+
+    // 強制平倉之後：最後一天的淨值用平倉後的現金
+    SimMetrics finishMetrics() {
+        if (hasPending) commitEquity(cash);
+        SimMetrics m;
+        m.maxDrawdown = maxDD * 100.0;
+        if (retCount >= 2) {
+            double mean = retSum / retCount;
+            double var = retSq / retCount - mean * mean;
+            if (var > 0) m.sharpe = mean / sqrt(var) * sqrt(252.0);
+        }
+        if (days > 0) m.exposure = 100.0 * inMarket / days;
+        if (closed > 0) m.winRate = 100.0 * wins / closed;
+        return m;
+    }
+
+    // 第 i 天的交叉訊號、用 price 成交；isFirstDay 時不開新倉
+    void onCross(bool golden, bool death, bool isFirstDay, double price, const TradeCost& c) {
+        // BUY：黃金交叉（做空中先回補）
+        if (golden) {
+            if constexpr (Rules::longShort) {
+                if (qty < 0) close(price, c);
+            }
+            if (!isFirstDay && qty == 0) open(+1, price, c);
+        }
+        // SELL：死亡交叉（long-short 接著放空）
+        else if (death) {
+            if (qty > 0) close(price, c);
+            if constexpr (Rules::longShort) {
+                if (!isFirstDay && qty == 0) open(-1, price, c);
+            }
+        }
+    }
+};
+
+// --------------------------------------------------
+// 模擬策略（只在指定 index 區間內交易）
+//   初始資金 10000，區間最後一天強制平倉（也算 1 次交易），其他規則見 StrategyRules
+//   simulateRangeRaw 吃指標（arena 用），simulateWithCapitalRange 吃 vector
+// --------------------------------------------------
+template <class Rules>
+SimResult simulateRangeKernel(
+    const double* prices,
+    int N,
+    const double* smaS,
+    const double* smaL,
+    int startIdx,
+    int endIdx,
+    const TradeCost& cost
+) {
+    if (N == 0) return { INITIAL, 0 };
+    if (startIdx < 0) startIdx = 0;
+    if (endIdx >= N)   endIdx = N - 1;
+    if (startIdx >= endIdx) return { INITIAL, 0 };
+
+    if (startIdx < 1) startIdx = 1;
+
+    const int delay = Rules::nextDayFill ? 1 : 0;
+    SimBook<Rules> book;
+
+    for (int i = startIdx; i + delay <= endIdx; ++i) {
+
+        double dPrev = smaS[i - 1] - smaL[i - 1];
+        double dNow = smaS[i] - smaL[i];
+        const double price = prices[i + delay];
+
+        bool valid = !(std::isnan(dPrev) || std::isnan(dNow));
+        if constexpr (Rules::nextDayFill) {
+            valid = valid && !std::isnan(price);   // 隔天缺值（--gaps reset）：不成交
+        }
+
+        if (valid) {
+            // =============================
+            // ★★ 新增：如果是第一天（i == startIdx），禁止 BUY （無視黃金交叉）
+            // =============================
+            bool isFirstDay = (i == startIdx);
+
+            book.onCross(dPrev < 0 && dNow > 0, dPrev > 0 && dNow < 0, isFirstDay, price, cost);
+        }
+        if constexpr (Rules::metrics) book.mark(price);
+    }
+
+    // 區間最後一天強制平倉
+    if (book.qty != 0) book.close(prices[endIdx], cost);
+
+    if constexpr (Rules::metrics) return { book.cash, book.trades, book.finishMetrics() };
+    else return { book.cash, book.trades };
+}
+
+// 只看事件序列做模擬（--engine dedupe）；每一步運算都跟 simulateRangeKernel 相同
+template <class Rules>
+SimResult simulateEventsKernel(
+    const double* prices,
+    const int* events,
+    int count,
+    int startIdx,
+    int endIdx,
+    const TradeCost& cost
+) {
+    SimBook<Rules> book;
+
+    // --metrics：每天都要記淨值，照天數走、遇到事件就處理（順序同 simulateRangeKernel）
+    if constexpr (Rules::metrics) {
+        const int delay = Rules::nextDayFill ? 1 : 0;
+        int k = 0;
+        for (int i = startIdx; i + delay <= endIdx; ++i) {
+            const double price = prices[i + delay];
+            for (; k < count && (events[k] >> 1) == i; ++k) {
+                bool golden = (events[k] & 1) == EVENT_GOLDEN;
+                if (!Rules::nextDayFill || !std::isnan(price)) {
+                    book.onCross(golden, !golden, false, price, cost);
+                }
+            }
+            book.mark(price);
+        }
+        if (book.qty != 0) book.close(prices[endIdx], cost);
+        return { book.cash, book.trades, book.finishMetrics() };
+    }
+
+    for (int k = 0; k < count; ++k) {
+        int i = events[k] >> 1;
+        bool golden = (events[k] & 1) == EVENT_GOLDEN;
+
+        if constexpr (Rules::nextDayFill) {
+            if (i + 1 > endIdx) break;      // 事件依日期排序，後面也都不會成交
+            if (std::isnan(prices[i + 1])) continue;
+            book.onCross(golden, !golden, false, prices[i + 1], cost);
+        }
+        else {
+            book.onCross(golden, !golden, false, prices[i], cost);
+        }
+    }
+
+    // 區間最後一天強制平倉
+    if (book.qty != 0) book.close(prices[endIdx], cost);
+    return { book.cash, book.trades };
+}
+
+// 目前規則對應的 kernel（main 解析完參數後設定一次）
+struct SimKernels {
+    SimResult(*range)(const double*, int, const double*, const double*, int, int, const TradeCost&);
+    SimResult(*events)(const double*, const int*, int, int, int, const TradeCost&);
+};
+
+template <class Rules>
+SimKernels simKernelsFor() {
+    return { simulateRangeKernel<Rules>, simulateEventsKernel<Rules> };
+}
+
+SimKernels g_sim = simKernelsFor<DefaultRules>();
+
+// 把執行期的五個開關逐一換成 template 參數
+template <bool... Fixed>
+SimKernels selectSimKernels(const bool* flags) {
+    if constexpr (sizeof...(Fixed) == 5) {
+        return simKernelsFor<StrategyRules<Fixed...>>();
+    }
+    else {
+        return flags[sizeof...(Fixed)] ? selectSimKernels<Fixed..., true>(flags)
+            : selectSimKernels<Fixed..., false>(flags);
+    }
+}
+
+// 是否用了預設以外的成交規則（只有 scan / dedupe 等走 g_sim 的路徑支援）
+bool customRules() {
+    return g_opt.fillNextDay || g_opt.fractional || g_opt.longShort || g_opt.cost.any() || g_opt.metrics;
+}
+
+// bnb 的上限只對「預設規則 + 依最終資金排名」成立（--sort trades 也不行）
+bool bnbCanPrune() {
+    return !customRules() && g_opt.sortKey == SortKey::Capital;
+}
+
+// --costs 的情境也要用有成本的 kernel（成本全為 0 時結果跟預設 kernel 相同）
+void initSimKernels() {
+    const bool flags[5] = { g_opt.fillNextDay, g_opt.fractional, g_opt.longShort,
+        g_opt.cost.any() || !g_opt.costScenarios.empty(), g_opt.metrics };
+    g_sim = selectSimKernels<>(flags);
+}
+
+SimResult simulateRangeRaw(
+    const double* prices,
+    int N,
+    const double* smaS,
+    const double* smaL,
+    int startIdx,
+    int endIdx
+) {
+    return g_sim.range(prices, N, smaS, smaL, startIdx, endIdx, g_opt.cost);
+}
+
+SimResult simulateWithCapitalRange(
+    const vector<double>& prices,
+    const vector<double>& smaS,
+    const vector<double>& smaL,
+    int startIdx,
+    int endIdx
+) {
+    return simulateRangeRaw(prices.data(), (int)prices.size(),
+        smaS.data(), smaL.data(), startIdx, endIdx);
+}
+
+// 一組 (s,l) 的模擬狀態：預設規則的 SimBook 只需要這三個值（checkpoint 也存這個）
+//   各 engine 把狀態存成 PairState，推進時換成 SimBook<DefaultRules>，規則只寫在 SimBook
+struct PairState {
+    double cash;
+    int shares;
+    int trades;
+
+    SimBook<DefaultRules> book() const {
+        SimBook<DefaultRules> b;
+        b.cash = cash;
+        b.qty = shares;
+        b.trades = trades;
+        return b;
+    }
+    void store(const SimBook<DefaultRules>& b) { *this = { b.cash, b.qty, b.trades }; }
+};
+
+// --------------------------------------------------
+// 每一組 short/long 的結果，用來排序 & 輸出
+// --------------------------------------------------
+struct BruteResult {
+    int s;
+    int l;
+    double finalCapital;
+    int trades;
+    SimMetrics metrics = {};    // --metrics 才有值
+};
+
+// --------------------------------------------------
+// 預先把所有 period 的 SMA 算好：allSMA[n] = calcSMA(prices, n)
+//   allSMA[0] 不用（空的），讓 index 直接等於 period
+//   --indicator ema / wma 時放的是那種均線（名字沿用 SMA，各引擎不用改）
+// --------------------------------------------------
+vector<vector<double>> calcAllSMA(const vector<double>& prices, int maxN = MAXN) {
+    vector<vector<double>> allSMA(maxN + 1);
+    if (g_opt.indicator == Indicator::SMA) {
+        for (int n = 1; n <= maxN; n++) {
+            allSMA[n] = calcSMA(prices, n);
+        }
+        return allSMA;
+    }
+
+    vector<double*> rows(maxN + 1, nullptr);
+    for (int n = 1; n <= maxN; n++) {
+        allSMA[n].resize(prices.size());
+        rows[n] = allSMA[n].data();
+    }
+    vector<double> scratch(lineScratchSize(maxN));
+    calcAllLinesInto(prices.data(), (int)prices.size(), rows.data(), scratch.data(), maxN);
+    return allSMA;
+}
+
+// --------------------------------------------------
+// 跑完所有 short/long 組合（s, l 都是 1..MAXN），回傳未排序的結果
+//   順序：s 外圈、l 內圈
+//   --engine scan：每組各自 simulateWithCapitalRange（原本的作法）
+// --------------------------------------------------
+vector<BruteResult> runGridScan(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    int startIdx,
+    int endIdx
+) {
+    vector<BruteResult> results;
+    results.reserve(MAXN * MAXN);
+
+    for (int s = 1; s <= MAXN; s++) {
+        for (int l = 1; l <= MAXN; l++) {
+            SimResult sr = simulateWithCapitalRange(
+                prices, allSMA[s], allSMA[l],
+                startIdx, endIdx
+            );
+            results.push_back({ s, l, sr.finalCapital, sr.tradeCount, sr.metrics });
+        }
+    }
+    return results;
+}
+
+// --------------------------------------------------
+// 交叉事件去重（--costs；--bench 也會比較）
+//   模擬結果只由「區間內哪幾天出現黃金/死亡交叉」決定，相鄰的 (s,l)
+//   常常交叉在完全相同的日子。先把每組的事件序列抽出來（編碼成
+//   day*2 + 類型）做雜湊，同一個序列只模擬一次，結果分給所有相同的組合。
+//   區間第一天不會有任何動作（一開始沒持股、又禁止 BUY），所以不記。
+//   抽事件跟模擬一樣要掃完整區間，只有一個成本情境時比 scan 慢；
+//   多個情境共用同一次抽取、每個情境只走事件，才比每個情境各跑一次 scan 快。
+// --------------------------------------------------
+
+// 抽出一組 (s,l) 在 [startIdx, endIdx] 內的交叉事件（startIdx/endIdx 已修正過）
+void collectCrossEvents(
+    const vector<double>& smaS,
+    const vector<double>& smaL,
+    int startIdx,
+    int endIdx,
+    vector<int>& events
+) {
+    events.clear();
+    for (int i = startIdx + 1; i <= endIdx; ++i) {
+        double dPrev = smaS[i - 1] - smaL[i - 1];
+        double dNow = smaS[i] - smaL[i];
+
+        if (std::isnan(dPrev) || std::isnan(dNow)) continue;
+
+        if (dPrev < 0 && dNow > 0) events.push_back(i * 2 + EVENT_GOLDEN);
+        else if (dPrev > 0 && dNow < 0) events.push_back(i * 2 + EVENT_DEATH);
+    }
+}
+
+// 只看事件序列做模擬（規則同 simulateWithCapitalRange；cost 預設用主排名的成本）
+SimResult simulateEvents(
+    const vector<double>& prices,
+    const int* events,
+    int count,
+    int startIdx,
+    int endIdx,
+    const TradeCost& cost = g_opt.cost
+) {
+    return g_sim.events(prices.data(), events, count, startIdx, endIdx, cost);
+}
+
+// --------------------------------------------------
+// 多個成本情境一次算完（--costs）：交叉事件跟成本無關，
+// 每個不重複的事件序列抽一次、對每個情境各模擬一次（只走事件，不再掃整段歷史）
+//   回傳 results[c] = 第 c 個成本情境的所有組合（順序同 runGridScan）
+// --------------------------------------------------
+vector<vector<BruteResult>> runGridDedupeCosts(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    int startIdx,
+    int endIdx,
+    const vector<TradeCost>& costs
+) {
+    const int C = (int)costs.size();
+    vector<vector<BruteResult>> results(C);
+    for (auto& r : results) r.reserve(MAXN * MAXN);
+
+    // 跟 simulateWithCapitalRange 一樣修正區間
+    int N = (int)prices.size();
+    if (startIdx < 0) startIdx = 0;
+    if (endIdx >= N) endIdx = N - 1;
+    if (N == 0 || startIdx >= endIdx) {
+        for (auto& r : results)
+            for (int s = 1; s <= MAXN; s++)
+                for (int l = 1; l <= MAXN; l++)
+                    r.push_back({ s, l, INITIAL, 0 });
+        return results;
+    }
+    if (startIdx < 1) startIdx = 1;
+
+    // 不重複的事件序列：全部接在 pool 裡，distinct[k] 記起點/長度，
+    // 各情境的結果放在 simResults[k * C + c]
+    struct Distinct {
+        size_t offset;
+        int count;
+    };
+    vector<int> pool;
+    vector<Distinct> distinct;
+    vector<SimResult> simResults;
+    unordered_multimap<unsigned long long, int> byHash;
+    vector<int> events;
+
+    for (int s = 1; s <= MAXN; s++) {
+        for (int l = 1; l <= MAXN; l++) {
+            collectCrossEvents(allSMA[s], allSMA[l], startIdx, endIdx, events);
+
+            Fnv64 f;
+            f.add(events.data(), events.size() * sizeof(int));
+
+            // 雜湊相同還要逐一比對，確定真的是同一個序列
+            int found = -1;
+            auto range = byHash.equal_range(f.h);
+            for (auto it = range.first; it != range.second && found == -1; ++it) {
+                const Distinct& d = distinct[it->second];
+                if (d.count == (int)events.size()
+                    && equal(events.begin(), events.end(), pool.begin() + d.offset)) {
+                    found = it->second;
+                }
+            }
+
+            if (found == -1) {
+                Distinct d;
+                d.offset = pool.size();
+                d.count = (int)events.size();
+                for (int c = 0; c < C; ++c) {
+                    simResults.push_back(simulateEvents(prices, events.data(), d.count, startIdx, endIdx, costs[c]));
+                }
+                pool.insert(pool.end(), events.begin(), events.end());
+                found = (int)distinct.size();
+                distinct.push_back(d);
+                byHash.emplace(f.h, found);
+            }
+
+            for (int c = 0; c < C; ++c) {
+                const SimResult& sr = simResults[(size_t)found * C + c];
+                results[c].push_back({ s, l, sr.finalCapital, sr.tradeCount, sr.metrics });
+            }
+        }
+    }
+    return results;
+}
+
+vector<BruteResult> runGridDedupe(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    int startIdx,
+    int endIdx
+) {
+    return move(runGridDedupeCosts(prices, allSMA, startIdx, endIdx, { g_opt.cost })[0]);
+}
+
+// --------------------------------------------------
+// Branch-and-bound（--engine bnb，只在只需要前 keepTop 名時有效）
+//   growth[i] = 從第 i 天收盤到 endIdx 的「完美預知」最大倍數
+//             = Π max(1, p[j] / p[j-1])，j = i+1..endIdx
+//   不計手續費時，任何策略第 i 天的淨值（現金 + 持股市值）乘上 growth[i]
+//   就是它最後資金的上限。上限已經比目前第 keepTop 名還低的組合，
+//   不可能擠進前 keepTop 名，直接放棄（不放進結果）。
+//   前 keepTop 名（含同分排序）跟完整搜尋完全一樣。
+// --------------------------------------------------
+
+// 上限比較時多留的相對誤差空間（浮點運算的累積誤差遠小於這個）
+const double BOUND_SLACK = 1.0 + 1e-9;
+
+vector<double> calcGrowthBound(const vector<double>& prices, int endIdx) {
+    vector<double> growth(endIdx + 1, 1.0);
+    // 缺值（NaN，--gaps reset）的那天沒有價格：跨過去直接跟下一個有價格的日子比
+    double next = prices[endIdx];
+    for (int i = endIdx - 1; i >= 0; --i) {
+        if (std::isnan(prices[i])) {
+            growth[i] = growth[i + 1];
+            continue;
+        }
+        growth[i] = growth[i + 1] * max(1.0, next / prices[i]);
+        next = prices[i];
+    }
+    return growth;
+}
+
+// 規則同 simulateWithCapitalRange（startIdx/endIdx 已修正過），
+// 每天檢查上限，低於 threshold 就回傳 false
+bool simulateWithBound(
+    const vector<double>& prices,
+    const vector<double>& smaS,
+    const vector<double>& smaL,
+    int startIdx,
+    int endIdx,
+    const vector<double>& growth,
+    double threshold,
+    SimResult& out
+) {
+    SimBook<DefaultRules> book;
+
+    for (int i = startIdx; i <= endIdx; ++i) {
+        double equity = book.qty > 0 ? book.cash + (double)book.qty * prices[i] : book.cash;
+        if (equity * growth[i] * BOUND_SLACK < threshold) return false;
+
+        int sig = crossSignal(smaS[i - 1] - smaL[i - 1], smaS[i] - smaL[i]);
+        if (sig != 0) book.onCross(sig > 0, sig < 0, i == startIdx, prices[i], NO_COST);
+    }
+
+    // 區間最後一天強制平倉
+    if (book.qty != 0) book.close(prices[endIdx], NO_COST);
+    out = { book.cash, book.trades };
+    return true;
+}
+
+vector<BruteResult> runGridBnB(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    int startIdx,
+    int endIdx,
+    int keepTop
+) {
+    int N = (int)prices.size();
+    if (startIdx < 0) startIdx = 0;
+    if (endIdx >= N) endIdx = N - 1;
+    // 上限只對預設規則的最終資金有效：其他規則、--sort 不是 capital 時改用 scan
+    if (N == 0 || startIdx >= endIdx || !bnbCanPrune()) {
+        return runGridScan(prices, allSMA, startIdx, endIdx);
+    }
+    if (startIdx < 1) startIdx = 1;
+
+    vector<double> growth = calcGrowthBound(prices, endIdx);
+
+    vector<BruteResult> results;
+    results.reserve(MAXN * MAXN);
+
+    // 目前前 keepTop 名的資金（min-heap），堆頂就是門檻
+    priority_queue<double, vector<double>, greater<double>> topCapital;
+
+    for (int s = 1; s <= MAXN; s++) {
+        for (int l = 1; l <= MAXN; l++) {
+            double threshold = ((int)topCapital.size() < keepTop)
+                ? -numeric_limits<double>::infinity() : topCapital.top();
+
+            SimResult sr;
+            if (!simulateWithBound(prices, allSMA[s], allSMA[l],
+                startIdx, endIdx, growth, threshold, sr)) {
+                continue;
+            }
+            results.push_back({ s, l, sr.finalCapital, sr.tradeCount });
+
+            topCapital.push(sr.finalCapital);
+            if ((int)topCapital.size() > keepTop) topCapital.pop();
+        }
+    }
+    return results;
+}
+
+// --------------------------------------------------
+// Cache 分塊（--engine tiled）
+//   原本 s 外圈、l 內圈、每組從頭掃到尾：allSMA[l] 整段被讀了 65,536 次。
+//   改成「一塊 pairBlock x pairBlock 的組合 x 一段 dayBlock 天」一起推進，
+//   這塊用到的 2 x pairBlock 條 SMA 片段（約 2 * pairBlock * dayBlock * 8 bytes）
+//   留在 L1/L2 裡重複使用；每組的狀態（現金/股數/交易次數）跨天段保存。
+//   分塊大小在第一次使用時用實際資料試跑挑最快的（autoTuneTiles）。
+// --------------------------------------------------
+struct TileConfig {
+    int pairBlock;
+    int dayBlock;
+};
+
+TileConfig g_tile = { 16, 256 };
+once_flag g_tileTuned;
+
+vector<BruteResult> runGridTiled(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    int startIdx,
+    int endIdx,
+    TileConfig tile,
+    int maxN = MAXN         // 只跑 period 1..maxN（autoTuneTiles 試跑用）
+) {
+    int N = (int)prices.size();
+    if (startIdx < 0) startIdx = 0;
+    if (endIdx >= N) endIdx = N - 1;
+    if (N == 0 || startIdx >= endIdx) {
+        return runGridScan(prices, allSMA, startIdx, endIdx);
+    }
+    if (startIdx < 1) startIdx = 1;
+
+    vector<PairState> state(MAXN * MAXN, PairState{ INITIAL, 0, 0 });
+    const int B = tile.pairBlock;
+    const int D = tile.dayBlock;
+
+    for (int s0 = 1; s0 <= maxN; s0 += B) {
+        int s1 = min(s0 + B - 1, maxN);
+        for (int l0 = 1; l0 <= maxN; l0 += B) {
+            int l1 = min(l0 + B - 1, maxN);
+            for (int d0 = startIdx; d0 <= endIdx; d0 += D) {
+                int d1 = min(d0 + D - 1, endIdx);
+
+                for (int s = s0; s <= s1; s++) {
+                    const double* smaS = allSMA[s].data();
+                    for (int l = l0; l <= l1; l++) {
+                        const double* smaL = allSMA[l].data();
+                        PairState& ps = state[(s - 1) * MAXN + (l - 1)];
+                        SimBook<DefaultRules> book = ps.book();   // 天段內用區域變數，留在暫存器
+
+                        for (int i = d0; i <= d1; ++i) {
+                            int sig = crossSignal(smaS[i - 1] - smaL[i - 1], smaS[i] - smaL[i]);
+                            if (sig != 0) book.onCross(sig > 0, sig < 0, i == startIdx, prices[i], NO_COST);
+                        }
+                        ps.store(book);
+                    }
+                }
+            }
+        }
+    }
+
+    vector<BruteResult> results;
+    results.reserve(maxN * maxN);
+    for (int s = 1; s <= maxN; s++) {
+        for (int l = 1; l <= maxN; l++) {
+            SimBook<DefaultRules> book = state[(s - 1) * MAXN + (l - 1)].book();
+            // 區間最後一天強制平倉
+            if (book.qty != 0) book.close(prices[endIdx], NO_COST);
+            results.push_back({ s, l, book.cash, book.trades });
+        }
+    }
+    return results;
+}
+
+// 候選的分塊大小（autoTuneTiles / --bench 共用）
+const int TILE_PAIR_CANDIDATES[] = { 8, 16, 32, 64 };
+const int TILE_DAY_CANDIDATES[] = { 64, 256, 1024 };
+
+// 試跑只用一小塊：最後 TILE_TUNE_DAYS 天 x period 1..TILE_TUNE_PERIODS。
+// 每個分塊的工作集只看 pairBlock/dayBlock，跟總組合數、總天數無關，
+// 小範圍挑出來的大小在全範圍一樣適用。組合數是完整網格的 1/16，
+// 12 個候選加起來最多約等於跑 0.75 次完整網格（區間超過 1024 天時更少）；
+// 原本每個候選都跑完整網格，啟動要多花約 12 次網格的時間。
+const int TILE_TUNE_DAYS = 1024;        // = 最大的 dayBlock 候選
+const int TILE_TUNE_PERIODS = 64;       // = 最大的 pairBlock 候選
+
+// --------------------------------------------------
+// 用第一次呼叫時的實際資料試跑每個候選分塊，挑最快的存到 g_tile
+// --------------------------------------------------
+void autoTuneTiles(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    int startIdx,
+    int endIdx
+) {
+    if (endIdx >= (int)prices.size()) endIdx = (int)prices.size() - 1;
+    int tuneStart = max(startIdx, endIdx - TILE_TUNE_DAYS + 1);
+    int tuneN = min(TILE_TUNE_PERIODS, MAXN);
+
+    double bestSec = numeric_limits<double>::infinity();
+    for (int b : TILE_PAIR_CANDIDATES) {
+        for (int d : TILE_DAY_CANDIDATES) {
+            auto t0 = chrono::steady_clock::now();
+            runGridTiled(prices, allSMA, tuneStart, endIdx, { b, d }, tuneN);
+            double sec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            if (sec < bestSec) {
+                bestSec = sec;
+                g_tile = { b, d };
+            }
+        }
+    }
+    cout << "分塊自動調整：pairBlock=" << g_tile.pairBlock
+        << " dayBlock=" << g_tile.dayBlock << "\n";
+}
+
+// --------------------------------------------------
+// Day-major 的 SMA 矩陣：sma[day][period]
+//   allSMA 是 [period][day]，一次推進很多組合時每天要從 256 條不同陣列各拿一個值；
+//   改成每一天一列、列首 64-byte 對齊，一天的所有 period 連續放在幾條 cache line 裡，
+//   可以用連續的向量載入。直接從價格算（每天更新所有 period 的滾動總和，
+//   加減順序同 calcSMA，數值逐位元相同）。
+// --------------------------------------------------
+struct DayMajorSMA {
+    int N = 0;              // 天數
+    int stride = 0;         // 每列 double 個數（period 0..MAXN，補到 8 的倍數 = 64 bytes）
+    double* data = nullptr;
+
+    DayMajorSMA() = default;
+    DayMajorSMA(const DayMajorSMA&) = delete;
+    DayMajorSMA& operator=(const DayMajorSMA&) = delete;
+    DayMajorSMA(DayMajorSMA&& o) noexcept : N(o.N), stride(o.stride), data(o.data) { o.data = nullptr; }
+    ~DayMajorSMA() {
+        if (data) ::operator delete[](data, align_val_t(64));
+    }
+
+    const double* day(int i) const { return data + (size_t)i * stride; }
+    double* day(int i) { return data + (size_t)i * stride; }
+};
+
+DayMajorSMA calcDayMajorSMA(const vector<double>& p, int maxN = MAXN) {
+    DayMajorSMA m;
+    m.N = (int)p.size();
+    m.stride = (maxN + 1 + 7) / 8 * 8;
+    m.data = (double*)::operator new[](sizeof(double) * (size_t)m.N * m.stride, align_val_t(64));
+
+    const double NaN = numeric_limits<double>::quiet_NaN();
+    vector<double> sums(maxN + 1, 0.0);
+    for (int i = 0; i < m.N; ++i) {
+        double* row = m.day(i);
+        row[0] = NaN;
+        for (int n = 1; n <= maxN; n++) {
+            if (i < n - 1) {
+                sums[n] += p[i];
+                row[n] = NaN;
+            }
+            else if (i == n - 1) {
+                sums[n] += p[i];
+                row[n] = sums[n] / n;
+            }
+            else {
+                sums[n] += p[i] - p[i - n];
+                row[n] = sums[n] / n;
+            }
+        }
+        for (int n = maxN + 1; n < m.stride; n++) row[n] = NaN;
+    }
+    return m;
+}
+
+// 從已經算好的 allSMA 轉成 day-major（--gaps reset 的 SMA 不是單純的滾動總和）
+DayMajorSMA transposeToDayMajor(const vector<vector<double>>& allSMA) {
+    DayMajorSMA m;
+    const int maxN = (int)allSMA.size() - 1;
+    m.N = maxN >= 1 ? (int)allSMA[1].size() : 0;
+    m.stride = (maxN + 1 + 7) / 8 * 8;
+    m.data = (double*)::operator new[](sizeof(double) * (size_t)m.N * m.stride, align_val_t(64));
+
+    const double NaN = numeric_limits<double>::quiet_NaN();
+    for (int i = 0; i < m.N; ++i) {
+        double* row = m.day(i);
+        row[0] = NaN;
+        for (int n = 1; n <= maxN; n++) row[n] = allSMA[n][i];
+        for (int n = maxN + 1; n < m.stride; n++) row[n] = NaN;
+    }
+    return m;
+}
+
+// --------------------------------------------------
+// 批次模擬（--engine batched）：天數外圈，一天推進全部 65,536 組
+//   每組的狀態是一個 PairState，同一個 s 的那一列 l 是連續的，
+//   讀的是同一天（和前一天）的 SMA 列；只有出現交叉的組合才換成 SimBook 成交。
+// --------------------------------------------------
+vector<BruteResult> runGridBatched(
+    const vector<double>& prices,
+    const DayMajorSMA& sma,
+    int startIdx,
+    int endIdx
+) {
+    int N = (int)prices.size();
+    if (startIdx < 0) startIdx = 0;
+    if (endIdx >= N) endIdx = N - 1;
+
+    const int P = MAXN * MAXN;
+    vector<PairState> state(P, PairState{ INITIAL, 0, 0 });
+
+    if (N > 0 && startIdx < endIdx) {
+        if (startIdx < 1) startIdx = 1;
+
+        for (int i = startIdx; i <= endIdx; ++i) {
+            const double* cur = sma.day(i);
+            const double* prev = sma.day(i - 1);
+            const double price = prices[i];
+            const bool isFirstDay = (i == startIdx);
+
+            for (int s = 1; s <= MAXN; s++) {
+                const double curS = cur[s];
+                const double prevS = prev[s];
+                // 短期 SMA 還是 NaN：整列的差值都是 NaN，直接跳過
+                if (std::isnan(curS) || std::isnan(prevS)) continue;
+
+                const int base = (s - 1) * MAXN - 1;   // base + l = 這組的 index
+                for (int l = 1; l <= MAXN; l++) {
+                    int sig = crossSignal(prevS - prev[l], curS - cur[l]);
+                    if (sig == 0) continue;
+
+                    PairState& ps = state[base + l];
+                    SimBook<DefaultRules> book = ps.book();
+                    book.onCross(sig > 0, sig < 0, isFirstDay, price, NO_COST);
+                    ps.store(book);
+                }
+            }
+        }
+
+        // 區間最後一天強制平倉
+        for (PairState& ps : state) {
+            SimBook<DefaultRules> book = ps.book();
+            if (book.qty != 0) book.close(prices[endIdx], NO_COST);
+            ps.store(book);
+        }
+    }
+
+    vector<BruteResult> results;
+    results.reserve(P);
+    for (int s = 1; s <= MAXN; s++) {
+        for (int l = 1; l <= MAXN; l++) {
+            const PairState& ps = state[(s - 1) * MAXN + (l - 1)];
+            results.push_back({ s, l, ps.cash, ps.trades });
+        }
+    }
+    return results;
+}
+
+// --------------------------------------------------
+// 依 --engine 選擇 grid 的實作（結果都一樣，只差在速度）
+//   keepTop > 0：呼叫端只會用到排序後的前 keepTop 名，
+//   結果裡可以不包含其他組合（bnb 會利用這點剪枝）
+// --------------------------------------------------
+vector<BruteResult> runGrid(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    int startIdx,
+    int endIdx,
+    int keepTop = 0
+) {
+    switch (g_opt.engine) {
+    case GridEngine::BnB:
+        if (keepTop > 0) return runGridBnB(prices, allSMA, startIdx, endIdx, keepTop);
+        return runGridScan(prices, allSMA, startIdx, endIdx);
+    case GridEngine::Tiled:
+        call_once(g_tileTuned, [&]() { autoTuneTiles(prices, allSMA, startIdx, endIdx); });
+        return runGridTiled(prices, allSMA, startIdx, endIdx, g_tile);
+    case GridEngine::Batched:
+        // 用自己的 day-major 矩陣（allSMA 用不到；--gaps reset 與 EMA / WMA 例外，直接轉置）
+        if (g_opt.gaps == GapPolicy::Reset || g_opt.indicator != Indicator::SMA) {
+            return runGridBatched(prices, transposeToDayMajor(allSMA), startIdx, endIdx);
+        }
+        return runGridBatched(prices, calcDayMajorSMA(prices), startIdx, endIdx);
+    case GridEngine::Scan:
+    default:
+        return runGridScan(prices, allSMA, startIdx, endIdx);
+    }
+}
+
+// 一個排名目標的值（--sort、--pareto），統一換成「越大越好」
+double objectiveValue(const BruteResult& r, SortKey key) {
+    switch (key) {
+    case SortKey::Drawdown: return -r.metrics.maxDrawdown;
+    case SortKey::Sharpe:   return r.metrics.sharpe;
+    case SortKey::Exposure: return -r.metrics.exposure;
+    case SortKey::WinRate:  return r.metrics.winRate;
+    case SortKey::Trades:   return -(double)r.trades;
+    default: return r.finalCapital;
+    }
+}
+
+double sortValue(const BruteResult& r) {
+    return objectiveValue(r, g_opt.sortKey);
+}
+
+// --------------------------------------------------
+// 排序：依 finalCapital 由大到小（同分時看 |s-l|、s、l）
+//   --sort 其他指標時先比那個指標，同分再照原本的規則
+// --------------------------------------------------
+bool betterResult(const BruteResult& a, const BruteResult& b) {
+    if (g_opt.sortKey != SortKey::Capital) {
+        double ka = sortValue(a), kb = sortValue(b);
+        if (ka != kb) return ka > kb;
+    }
+
+    if (a.finalCapital != b.finalCapital)
+        return a.finalCapital > b.finalCapital;   // 資金多的在前
+
+    int da = std::abs(a.s - a.l);
+    int db = std::abs(b.s - b.l);
+    if (da != db)
+        return da > db;                            // 距離短的在前
+
+    if (a.s != b.s)
+        return a.s < b.s;                          // 再用 s 當第三鍵
+    return a.l < b.l;                              // 最後用 l
+}
+
+void sortResults(vector<BruteResult>& results) {
+    sort(results.begin(), results.end(), betterResult);
+}
+
+// ==================================================
+// Pareto front（--pareto capital,drawdown,trades）
+//   在 2 ~ 3 個目標上都不被其他組合支配（每個目標都不比較差、至少一個比較好）的組合。
+//   skyline：依目標值由大到小排序後掃一遍，已經掃過的點第一個目標都不比較小，
+//   只要看後兩個目標：用 map 存一條階梯（第二目標越大、第三目標越小），
+//   每個點 lower_bound 一次就知道有沒有被支配，總共 O(n log n)。
+//   所有目標都一樣的組合彼此不支配，一起留或一起丟；輸出時每個點只寫
+//   依 betterResult 排最前面的那一組（不然「完全不交易」那一大群會灌爆輸出）。
+//   65,536 組先分塊各自算 front（平行），再對各塊 front 的聯集算一次。
+// ==================================================
+struct ParetoPoint {
+    double v[3];    // 各目標的值（越大越好；只有兩個目標時 v[2] = 0）
+    int idx;        // 在結果陣列裡的位置
+};
+
+// 回傳 pts 裡不被支配的點（會重排 pts）
+vector<ParetoPoint> skylineFront(vector<ParetoPoint>& pts) {
+    auto sameValues = [](const ParetoPoint& a, const ParetoPoint& b) {
+        return a.v[0] == b.v[0] && a.v[1] == b.v[1] && a.v[2] == b.v[2];
+    };
+    sort(pts.begin(), pts.end(), [](const ParetoPoint& a, const ParetoPoint& b) {
+        for (int d = 0; d < 3; ++d) {
+            if (a.v[d] != b.v[d]) return a.v[d] > b.v[d];
+        }
+        return a.idx < b.idx;
+    });
+
+    map<double, double> stairs;     // 第二目標 → 第三目標
+    vector<ParetoPoint> front;
+    for (size_t i = 0; i < pts.size(); ) {
+        size_t j = i + 1;
+        while (j < pts.size() && sameValues(pts[j], pts[i])) ++j;
+
+        const double b = pts[i].v[1];
+        const double c = pts[i].v[2];
+        auto it = stairs.lower_bound(b);
+        if (it == stairs.end() || it->second < c) {
+            front.insert(front.end(), pts.begin() + i, pts.begin() + j);
+
+            // 階梯上第二、第三目標都不比這個點大的舊點拿掉
+            if (it != stairs.end() && it->first == b) it = stairs.erase(it);
+            while (it != stairs.begin()) {
+                auto prev = std::prev(it);
+                if (prev->second > c) break;
+                stairs.erase(prev);
+            }
+            stairs.emplace_hint(it, b, c);
+        }
+        i = j;
+    }
+    return front;
+}
+
+// 對 count 筆結果算 Pareto front：每個點一組代表、依 betterResult 排好；
+// members = front 上的組合總數（含目標值相同的）
+vector<BruteResult> paretoFront(const BruteResult* results, int count, int& members) {
+    const vector<SortKey>& keys = g_opt.paretoKeys;
+    auto makePoint = [&](int i) {
+        ParetoPoint p = { { 0.0, 0.0, 0.0 }, i };
+        for (size_t d = 0; d < keys.size(); ++d) p.v[d] = objectiveValue(results[i], keys[d]);
+        return p;
+    };
+
+    // 分塊平行算各自的 front（被塊內支配的點一定也被全域支配）
+    const int chunks = max(1, min(workerCount(), count / 4096));
+    vector<vector<ParetoPoint>> local(chunks);
+    parallelFor(chunks, [&](int c) {
+        int a = (int)((long long)count * c / chunks);
+        int b = (int)((long long)count * (c + 1) / chunks);
+        vector<ParetoPoint> pts;
+        pts.reserve(b - a);
+        for (int i = a; i < b; ++i) pts.push_back(makePoint(i));
+        local[c] = skylineFront(pts);
+    });
+
+    vector<ParetoPoint> merged;
+    for (const auto& l : local) merged.insert(merged.end(), l.begin(), l.end());
+    if (chunks > 1) merged = skylineFront(merged);
+
+    members = (int)merged.size();
+    sort(merged.begin(), merged.end(), [&](const ParetoPoint& a, const ParetoPoint& b) {
+        return betterResult(results[a.idx], results[b.idx]);
+    });
+    set<array<double, 3>> seen;
+    vector<BruteResult> front;
+    for (const auto& p : merged) {
+        if (seen.insert({ p.v[0], p.v[1], p.v[2] }).second) front.push_back(results[p.idx]);
+    }
+    return front;
+}
+
+// 目標清單的文字（用 / 隔開，可以直接放進分段標題）
+string paretoKeyList() {
+    static const char* names[] = { "capital", "drawdown", "sharpe", "exposure", "winrate", "trades" };
+    string s;
+    for (SortKey k : g_opt.paretoKeys) s += string(s.empty() ? "" : "/") + names[(int)k];
+    return s;
+}
+
+// 排名檔的欄位名稱；--metrics 時後面多四欄
+const char* RANK_HEADER = "排名,短期,長期,最終獲利,報酬率,交易次數";
+const char* METRIC_HEADER = ",最大回撤,Sharpe,持有比例,勝率";
+
+string rankHeader() {
+    return string(RANK_HEADER) + (g_opt.metrics ? METRIC_HEADER : "");
+}
+
+// 風險指標的文字（CSV / console 共用，小數 4 位）
+string formatMetrics(const SimMetrics& m, const char* sep) {
+    char buf[160];
+    snprintf(buf, sizeof(buf), "%.4f%s%.4f%s%.4f%s%.4f",
+        m.maxDrawdown, sep, m.sharpe, sep, m.exposure, sep, m.winRate);
+    return buf;
+}
+
+// --------------------------------------------------
+// 把前 topN 名寫成 CSV 列（排名,短期,長期,'最終獲利,'報酬率,交易次數[,回撤,Sharpe,持有比例,勝率]）
+//   檔案輸出 & daemon 回應共用同一個格式
+// --------------------------------------------------
+void writeRankRows(ostream& out, const vector<BruteResult>& results, int topN) {
+    // 這邊用文字輸出：把數值包在雙引號裡
+    for (int i = 0; i < topN && i < (int)results.size(); ++i) {
+        const auto& r = results[i];
+        double ret = (r.finalCapital / INITIAL - 1.0) * 100.0;
+
+        std::ostringstream capSs;
+        capSs << std::fixed << std::setprecision(30) << r.finalCapital;
+        std::string capStr = capSs.str();
 
         std::ostringstream retSs;
         retSs << std::fixed << std::setprecision(4) << ret;
         std::string retStr = retSs.str();
 
-        // ★ 在前面加一個單引號，讓 Excel 當文字
-        std::string capField = "'" + capStr;
-        std::string retField = "'" + retStr;
+        // ★ 在前面加一個單引號，讓 Excel 當文字
+        std::string capField = "'" + capStr;
+        std::string retField = "'" + retStr;
+
+        out << (i + 1) << ","     // 排名（數字）
+            << r.s << ","         // 短期
+            << r.l << ","         // 長期
+            << capField << ","    // 最終獲利（文字）
+            << retField << ","    // 報酬率（文字）
+            << r.trades;          // 交易次數（數字）
+        if (g_opt.metrics) out << "," << formatMetrics(r.metrics, ",");
+        out << "\n";
+    }
+}
+
+// ==================================================
+// 結果快取（--cache-dir <dir>）
+//   key = FNV-1a 64 雜湊：symbol、價格序列 [0, endIdx]（SMA 的滾動總和
+//   從第 0 天開始累加，浮點誤差跟整段前綴有關，所以要整段）、起訖日期、
+//   period 範圍、策略規則、INITIAL、topN
+//   檔案內容：第一行最佳組合，之後是排序好的前 topN 名（%.17g，讀回來逐位元相同）
+//   checkpoint（--checkpoint <dir>）用同樣的 key 與檔案格式
+// ==================================================
+
+// 交易成本的描述（快取 key、--costs 每段的標題）
+string costLabel(const TradeCost& c) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "fixed=%.10g fee=%.10g slip=%.10g", c.fixed, c.rate, c.slip);
+    return buf;
+}
+
+// 策略規則的描述字串；規則改了這裡也要改，舊的快取就自動失效
+string strategyTag() {
+    string tag = string(indicatorName(g_opt.indicator)) + "-cross;no-buy-first-day;"
+        + (g_opt.fillNextDay ? "fill-next-close;" : "fill-same-close;")
+        + (g_opt.fractional ? "frac-shares;" : "int-shares;")
+        + "force-close-end";
+    if (g_opt.longShort) tag += ";long-short";
+    if (g_opt.cost.any()) tag += ";" + costLabel(g_opt.cost);
+    if (g_opt.metrics) tag += ";metrics";
+    if (g_opt.sortKey != SortKey::Capital) tag += ";sort=" + to_string((int)g_opt.sortKey);
+    if (g_opt.gaps != GapPolicy::Drop) tag += string(";gaps=") + gapPolicyName(g_opt.gaps);
+    return tag;
+}
+
+string resultCachePath(
+    const string& dir,
+    const string& symbol,
+    const double* prices,
+    int startIdx,
+    int endIdx,
+    int topN
+) {
+    Fnv64 f;
+    f.add(symbol);
+    f.add(prices, sizeof(double) * (size_t)(endIdx + 1));
+    f.add(g_data[startIdx].date);
+    f.add(g_data[endIdx].date);
+    f.addPod(startIdx);
+    f.addPod(MAXN);
+    f.add(strategyTag());
+    f.addPod(INITIAL);
+    f.addPod(topN);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.csv", f.h);
+    return dir + "/" + symbol + "_" + name;
+}
+
+bool readResultRows(istream& in, vector<BruteResult>& results, BruteResult& best) {
+    auto parseRow = [](const string& line, BruteResult& r) {
+        SimMetrics& m = r.metrics;
+        int n = sscanf(line.c_str(), "%d,%d,%lf,%d,%lf,%lf,%lf,%lf", &r.s, &r.l, &r.finalCapital, &r.trades,
+            &m.maxDrawdown, &m.sharpe, &m.exposure, &m.winRate);
+        return n == (g_opt.metrics ? 8 : 4);
+    };
+
+    string line;
+    if (!getline(in, line) || !parseRow(line, best)) return false;
+    results.clear();
+    while (getline(in, line)) {
+        BruteResult r;
+        if (!parseRow(line, r)) return false;
+        results.push_back(r);
+    }
+    return true;
+}
+
+bool loadResultCache(const string& path, vector<BruteResult>& results, BruteResult& best) {
+    ifstream in(path);
+    if (!in.is_open()) return false;
+    return readResultRows(in, results, best);
+}
+
+void writeResultRows(ostream& out, const BruteResult* sorted, int count,
+    const BruteResult& best, int topN)
+{
+    auto writeRow = [&out](const BruteResult& r) {
+        char buf[224];
+        int n = snprintf(buf, sizeof(buf), "%d,%d,%.17g,%d", r.s, r.l, r.finalCapital, r.trades);
+        if (g_opt.metrics) {
+            const SimMetrics& m = r.metrics;
+            snprintf(buf + n, sizeof(buf) - n, ",%.17g,%.17g,%.17g,%.17g",
+                m.maxDrawdown, m.sharpe, m.exposure, m.winRate);
+        }
+        out << buf << "\n";
+    };
+    writeRow(best);
+    for (int i = 0; i < topN && i < count; ++i) writeRow(sorted[i]);
+}
+
+void saveResultCache(const string& path, const vector<BruteResult>& sorted,
+    const BruteResult& best, int topN)
+{
+    error_code ec;
+    filesystem::create_directories(filesystem::path(path).parent_path(), ec);
+
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp);
+        if (!out.is_open()) {
+            cerr << "無法寫入快取: " << path << "\n";
+            return;
+        }
+        writeResultRows(out, sorted.data(), (int)sorted.size(), best, topN);
+    }
+    filesystem::rename(tmp, path, ec);
+}
+
+// --------------------------------------------------
+// 單檔算到一半的 checkpoint（<完成檔>.part）
+//   第一行：下一個要算的 s；之後同快取格式，是 s < 下一列那些組合的
+//   最佳組合與前 topN 名（betterResult 是全序，之後再跟剩下的列合併，
+//   前 topN 名跟一口氣算完一樣）
+// --------------------------------------------------
+bool loadPartialCheckpoint(const string& path, int& nextS, vector<BruteResult>& top, BruteResult& best) {
+    ifstream in(path);
+    if (!in.is_open()) return false;
+    string line;
+    if (!getline(in, line) || sscanf(line.c_str(), "%d", &nextS) != 1 || nextS < 2 || nextS > MAXN) {
+        return false;
+    }
+    return readResultRows(in, top, best);
+}
+
+void savePartialCheckpoint(const string& path, int nextS, const BruteResult* sorted, int count,
+    const BruteResult& best, int topN)
+{
+    error_code ec;
+    filesystem::create_directories(filesystem::path(path).parent_path(), ec);
+
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp);
+        if (!out.is_open()) {
+            cerr << "無法寫入 checkpoint: " << path << "\n";
+            return;
+        }
+        out << nextS << "\n";
+        writeResultRows(out, sorted, count, best, topN);
+    }
+    filesystem::rename(tmp, path, ec);
+}
+
+// --------------------------------------------------
+// 最佳組合：未排序結果裡第一個出現的最大 finalCapital（s 外圈、l 內圈的順序）
+// --------------------------------------------------
+BruteResult findBest(const vector<BruteResult>& results) {
+    BruteResult best = { -1, -1, -1e18, 0 };
+    for (const auto& r : results) {
+        if (r.finalCapital > best.finalCapital) best = r;
+    }
+    return best;
+}
+
+// --------------------------------------------------
+// 拿到一檔的組合結果之後：Console 顯示最佳組合 + 前 topN 名，
+// 排序後 append 一段到同一個 CSV（批次 / 增量模式 / 快取共用）
+//   檔案格式（整檔）：
+//   排名,短期,長期,最終獲利,報酬率,交易次數
+//   AAPL 的 20 筆
+//   空行
+//   MMM,,,,,
+//   MMM 的 20 筆
+//   空行
+//   KO,,,,,
+//   ...
+//   ★ 金額 & 報酬率用雙引號包起來，讓 Excel 當文字，不會吃精度。
+// --------------------------------------------------
+void reportAndAppend(
+    vector<BruteResult>& results,
+    const BruteResult& best,
+    const string& label,
+    ofstream& fout,
+    bool isFirstSymbol,
+    int topN
+) {
+    // Console 上顯示一下這檔的最佳組合
+    cout << "\n==== " << label << " ====\n";
+    cout << "最佳組合： short=" << best.s
+        << " long=" << best.l
+        << " final_capital=" << best.finalCapital << "\n";
+
+    // 排序：依 finalCapital 由大到小
+    sortResults(results);
+
+    // Console 印出前 topN 名
+    cout << "\n排名\t短期\t長期\t最終獲利\t報酬率\t交易次數"
+        << (g_opt.metrics ? "\t最大回撤\tSharpe\t持有比例\t勝率" : "") << "\n";
+    cout << fixed << setprecision(4);
+    for (int i = 0; i < topN && i < (int)results.size(); ++i) {
+        const auto& r = results[i];
+        double ret = (r.finalCapital / INITIAL - 1.0) * 100.0;
+        cout << (i + 1) << "\t"
+            << r.s << "\t"
+            << r.l << "\t"
+            << r.finalCapital << "\t"
+            << ret << "\t"
+            << r.trades;
+        if (g_opt.metrics) cout << "\t" << formatMetrics(r.metrics, "\t");
+        cout << "\n";
+    }
+
+    // ===== 寫進同一個 CSV 檔 =====
+    // 第一檔（例如 AAPL）就直接寫排名資料；
+    // 之後的 MMM/KO/V/CAT 先插一行「MMM,,,,,」，再空一行，再寫排名。
+    if (!isFirstSymbol) {
+        fout << label << ",,,,,\n\n";  // 分段標題 + 空白行
+    }
+
+    writeRankRows(fout, results, topN);
+    fout << "\n";  // 每檔最後再空一行，視覺上比較像你貼的樣子
+
+    cout << "寫入完成：" << label << "\n";
+}
+
+// ==================================================
+// Arena：每個 worker 一個，每檔 symbol 開始前 reset
+//   bump allocator，reset 只把指標歸零、不把記憶體還給 heap；
+//   如果上一輪用到不只一塊，reset 時合併成一整塊。第一檔跑完容量就夠了，
+//   之後每檔的 prices / SMA 表 / 65,536 筆結果都不會再向 heap 要記憶體。
+//   只放 trivially copyable 的型別（double、BruteResult ...）。
+// ==================================================
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { releaseAll(); }
+
+    template <typename T>
+    T* alloc(size_t count) {
+        size_t bytes = (count * sizeof(T) + 63) / 64 * 64;
+        if (blocks_.empty() || blocks_.back().used + bytes > blocks_.back().size) {
+            size_t last = blocks_.empty() ? 0 : blocks_.back().size;
+            addBlock(max(bytes, last * 2));
+        }
+        Block& b = blocks_.back();
+        T* p = (T*)(b.data + b.used);
+        b.used += bytes;
+        return p;
+    }
+
+    // 預先準備至少 bytes 的容量（已經夠就不動）
+    void reserve(size_t bytes) {
+        if (capacity() >= bytes) return;
+        releaseAll();
+        addBlock(bytes);
+    }
+
+    void reset() {
+        if (blocks_.size() > 1) {
+            size_t total = 0;
+            for (auto& b : blocks_) total += b.size;
+            releaseAll();
+            addBlock(total);
+        }
+        for (auto& b : blocks_) b.used = 0;
+    }
+
+    size_t heapAllocs() const { return heapAllocs_; }
+    size_t capacity() const {
+        size_t total = 0;
+        for (auto& b : blocks_) total += b.size;
+        return total;
+    }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+        size_t used;
+    };
+
+    void addBlock(size_t bytes) {
+        char* p = (char*)::operator new[](bytes, align_val_t(64));
+        blocks_.push_back({ p, bytes, 0 });
+        heapAllocs_++;
+    }
+
+    void releaseAll() {
+        for (auto& b : blocks_) ::operator delete[](b.data, align_val_t(64));
+        blocks_.clear();
+    }
+
+    vector<Block> blocks_;
+    size_t heapAllocs_ = 0;
+};
+
+vector<unique_ptr<Arena>> g_arenas;   // 一個 worker 一個
+
+// 一檔 symbol 在 arena 裡要用的量：prices + (MAXN+1) 列 SMA + 65,536 筆結果（各自 64-byte 對齊）
+size_t arenaBytesPerSymbol() {
+    auto aligned = [](size_t b) { return (b + 63) / 64 * 64; };
+    size_t N = g_data.size();
+    return aligned(N * sizeof(double))
+        + aligned((MAXN + 1) * N * sizeof(double))
+        + aligned(lineScratchSize() * sizeof(double))
+        + aligned((size_t)MAXN * MAXN * sizeof(BruteResult));
+}
+
+void ensureArenas(int workers) {
+    while ((int)g_arenas.size() < workers) g_arenas.emplace_back(new Arena());
+    for (auto& a : g_arenas) a->reserve(arenaBytesPerSymbol());
+}
+
+void printArenaStats() {
+    size_t allocs = 0, bytes = 0;
+    for (auto& a : g_arenas) {
+        allocs += a->heapAllocs();
+        bytes += a->capacity();
+    }
+    cout << "arena：" << g_arenas.size() << " 個 worker，共向 heap 配置 "
+        << allocs << " 次，容量 " << fixed << setprecision(1)
+        << bytes / (1024.0 * 1024.0) << " MB\n";
+}
+
+// ==================================================
+// 記憶體預算（--mem-budget <MB>）
+//   每個工作（一檔 symbol / 一個 walk-forward 視窗）的記憶體用量可以從
+//   天數 N、period 範圍（MAXN）和 engine 事先估出來；同時跑的工作數
+//   = min(thread 數, 預算 / 每個工作的估計量)，至少 1 個。
+//   預算只管平行工作的暫存，不含 g_data 本身（啟動時會印出來）。
+//   結束時印出 peak RSS，可以拿來校正預算。
+// ==================================================
+size_t estimateTaskBytes() {
+    const size_t N = g_data.size();
+    const size_t P = (size_t)MAXN * MAXN;
+    const size_t smaBytes = (MAXN + 1) * N * sizeof(double);
+
+    // --costs：每個情境各一份結果，事件表同 dedupe
+    if (!g_opt.costScenarios.empty()) {
+        const size_t C = g_opt.costScenarios.size() + 1;
+        return arenaBytesPerSymbol() + N * sizeof(double) + smaBytes
+            + P * C * (sizeof(BruteResult) + sizeof(SimResult)) + P * (8 * sizeof(int) + 48 + 48);
+    }
+
+    if (g_opt.engine == GridEngine::Scan) return arenaBytesPerSymbol();
+
+    // 其他 engine：vector 版的 prices + allSMA + 65,536 筆結果，再加各自的工作區
+    size_t bytes = N * sizeof(double) + smaBytes + P * sizeof(BruteResult);
+    switch (g_opt.engine) {
+    case GridEngine::BnB:
+        bytes += N * sizeof(double);
+        break;
+    case GridEngine::Tiled:
+        bytes += P * sizeof(PairState);
+        break;
+    case GridEngine::Batched:
+        bytes += N * ((MAXN + 1 + 7) / 8 * 8) * sizeof(double)
+            + P * (sizeof(double) + 2 * sizeof(int));
+        break;
+    default:
+        break;
+    }
+    return bytes;
+}
+
+// 在預算內最多能同時跑幾個工作
+int admittedWorkers(size_t taskBytes) {
+    int n = workerCount();
+    if (g_opt.memBudgetMB <= 0) return n;
+
+    size_t budget = (size_t)g_opt.memBudgetMB * 1024 * 1024;
+    int fit = (int)min<size_t>(budget / max<size_t>(taskBytes, 1), (size_t)n);
+    if (fit < 1) {
+        cerr << "記憶體預算 " << g_opt.memBudgetMB << " MB 不夠一個工作（約 "
+            << taskBytes / (1024 * 1024) << " MB），改成一次只跑一個\n";
+        fit = 1;
+    }
+    cout << "記憶體預算 " << g_opt.memBudgetMB << " MB，每個工作約 "
+        << fixed << setprecision(1) << taskBytes / (1024.0 * 1024.0)
+        << " MB → 同時 " << fit << " 個（thread 上限 " << n << "）\n";
+    return fit;
+}
+
+// 目前行程的 peak RSS（bytes），量不到回傳 0
+size_t peakRssBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return pmc.PeakWorkingSetSize;
+    return 0;
+#else
+    rusage ru{};
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+    return (size_t)ru.ru_maxrss;            // macOS 單位是 bytes
+#else
+    return (size_t)ru.ru_maxrss * 1024;     // Linux 單位是 KB
+#endif
+#endif
+}
+
+void reportPeakRss() {
+    size_t peak = peakRssBytes();
+    if (peak == 0) return;
+    cout << "peak RSS: " << fixed << setprecision(1) << peak / (1024.0 * 1024.0) << " MB\n";
+}
+
+// --------------------------------------------------
+// 一檔 symbol 的計算結果（先平行算完，再依順序寫檔）
+// --------------------------------------------------
+struct SymbolRank {
+    string error;               // 非空：這檔沒辦法算，寫檔時印出來
+    int startIdx = -1;
+    int endIdx = -1;
+    bool fromCache = false;
+    string cacheFile;           // 有開快取時的檔名（命中或要寫入）
+    bool fromCheckpoint = false;    // --resume：上次已經算完
+    int resumedAtS = 0;             // --resume：上次算到一半，從這個 s 接著算（0 = 從頭）
+    BruteResult best = { -1, -1, -1e18, 0 };
+    vector<BruteResult> top;    // 排序後的前 topN 名
+    vector<BruteResult> pareto;             // --pareto：主排名的 Pareto front（每個點一組，依 betterResult 排序）
+    int paretoMembers = 0;                  // --pareto：front 上的組合總數
+    vector<BruteResult> costBest;           // --costs：各情境的最佳組合
+    vector<vector<BruteResult>> costTop;    // --costs：各情境排序後的前 topN 名
+};
+
+// --------------------------------------------------
+// 對單一 symbol 跑 brute force（區間 --from ~ --to，預設 2024）
+//   scan engine：prices、allSMA（(MAXN+1) x N）、65,536 筆結果全部放在 arena
+//   其他 engine：照原本 calcAllSMA + runGrid（vector）
+//   --checkpoint：算完馬上存一份；scan engine 另外每 --checkpoint-rows 個 s
+//   存一次到目前為止的前 topN 名，--resume 時從那一列接著算
+// --------------------------------------------------
+void rankSymbol(const string& symbol, Arena& arena, int topN, SymbolRank& out) {
+    out.top.clear();
+    out.best = { -1, -1, -1e18, 0 };
+
+    int symIdx = findSymbolIndex(symbol);
+    if (symIdx == -1) {
+        out.error = "找不到 symbol: " + symbol;
+        return;
+    }
+
+    const int N = (int)g_data.size();
+    if (N == 0) {
+        out.error = "沒有任何 " + symbol + " 資料";
+        return;
+    }
+
+    // 找出區間（--from ~ --to，預設整個 2024）的起訖 index
+    if (!findDateRange(g_dateKeys, g_opt.fromKey, g_opt.toKey, out.startIdx, out.endIdx)) {
+        out.error = "找不到區間內的 " + symbol + " 資料";
+        return;
+    }
+    int startIdx = out.startIdx;
+    int endIdx = out.endIdx;
+
+    arena.reset();
+    double* prices = arena.alloc<double>(N);
+    for (int i = 0; i < N; ++i) prices[i] = g_data[i].prices[symIdx];
+
+    // 快取命中就不用重跑 brute force
+    if (!g_opt.cacheDir.empty()) {
+        out.cacheFile = resultCachePath(g_opt.cacheDir, symbol, prices, startIdx, endIdx, topN);
+        if (loadResultCache(out.cacheFile, out.top, out.best)) {
+            out.fromCache = true;
+            return;
+        }
+    }
+
+    string ckFile, partFile;
+    if (!g_opt.checkpointDir.empty()) {
+        ckFile = resultCachePath(g_opt.checkpointDir, symbol, prices, startIdx, endIdx, topN);
+        partFile = ckFile + ".part";
+        if (g_opt.resume && loadResultCache(ckFile, out.top, out.best)) {
+            out.fromCheckpoint = true;
+            return;
+        }
+    }
+
+    // 缺值處理（快取 key 用原始價格與日曆區間，所以放在這之後）：
+    // skip / ffill 會縮短序列，區間也換成整理後的 index
+    int Ns = N;
+    if (g_opt.gaps != GapPolicy::Drop) {
+        Ns = applyGapPolicy(symIdx, prices, N, startIdx, endIdx);
+        if (Ns == 0) {
+            out.error = "區間內沒有 " + symbol + " 的有效價格";
+            return;
+        }
+        out.startIdx = startIdx;
+        out.endIdx = endIdx;
+    }
+    const bool resetSMA = (g_opt.gaps == GapPolicy::Reset);
+
+    // --costs：主排名跟各成本情境共用同一次事件抽取（不管 --engine）
+    if (!g_opt.costScenarios.empty()) {
+        vector<double> pv(prices, prices + Ns);
+        vector<vector<double>> allSMA = resetSMA ? calcAllLinesReset(pv, g_valid[symIdx]) : calcAllSMA(pv);
+        vector<TradeCost> costs = { g_opt.cost };
+        costs.insert(costs.end(), g_opt.costScenarios.begin(), g_opt.costScenarios.end());
+        vector<vector<BruteResult>> results = runGridDedupeCosts(pv, allSMA, startIdx, endIdx, costs);
+
+        for (size_t c = 0; c < costs.size(); ++c) {
+            vector<BruteResult>& r = results[c];
+            BruteResult best = findBest(r);
+            if (c == 0 && !g_opt.paretoKeys.empty()) out.pareto = paretoFront(r.data(), (int)r.size(), out.paretoMembers);
+            int rows = min(topN, (int)r.size());
+            partial_sort(r.begin(), r.begin() + rows, r.end(), betterResult);
+            r.resize(rows);
+            if (c == 0) {
+                out.best = best;
+                out.top = move(r);
+            }
+            else {
+                out.costBest.push_back(best);
+                out.costTop.push_back(move(r));
+            }
+        }
+        return;
+    }
+
+    if (g_opt.engine != GridEngine::Scan) {
+        vector<double> pv(prices, prices + Ns);
+        vector<vector<double>> allSMA = resetSMA ? calcAllLinesReset(pv, g_valid[symIdx]) : calcAllSMA(pv);
+        vector<BruteResult> results = runGrid(pv, allSMA, startIdx, endIdx, topN);
+        out.best = findBest(results);
+        if (!g_opt.paretoKeys.empty()) out.pareto = paretoFront(results.data(), (int)results.size(), out.paretoMembers);
+        int rows = min(topN, (int)results.size());
+        partial_sort(results.begin(), results.begin() + rows, results.end(), betterResult);
+        out.top.assign(results.begin(), results.begin() + rows);
+        if (!ckFile.empty()) saveResultCache(ckFile, out.top, out.best, topN);
+        return;
+    }
+
+    // 預先把所有 period 的均線算好：第 n 列在 sma + n * Ns
+    double* sma = arena.alloc<double>((size_t)(MAXN + 1) * Ns);
+    if (resetSMA) {
+        for (int n = 1; n <= MAXN; n++) {
+            calcLineResetInto(prices, g_valid[symIdx], Ns, n, sma + (size_t)n * Ns);
+        }
+    }
+    else {
+        double* rows[MAXN + 1];
+        for (int n = 0; n <= MAXN; n++) rows[n] = sma + (size_t)n * Ns;
+        double* scratch = g_opt.indicator == Indicator::SMA ? nullptr : arena.alloc<double>(lineScratchSize());
+        calcAllLinesInto(prices, Ns, rows, scratch);
+    }
+
+    // 算出所有組合（s 外圈、l 內圈）
+    const int P = MAXN * MAXN;
+    const int rows = min(topN, P);
+    BruteResult* results = arena.alloc<BruteResult>(P);
+    int k = 0;
+    int firstS = 1;
+
+    // 上次算到一半：前面那些列只留下前 topN 名，放在最前面，之後的列接在後面
+    if (g_opt.resume && !partFile.empty()
+        && loadPartialCheckpoint(partFile, firstS, out.top, out.best)
+        && (int)out.top.size() <= min(rows, (firstS - 1) * MAXN)) {
+        out.resumedAtS = firstS;
+        k = (int)out.top.size();
+        copy(out.top.begin(), out.top.end(), results);
+    }
+    else {
+        firstS = 1;
+        out.best = { -1, -1, -1e18, 0 };
+    }
+
+    for (int s = firstS; s <= MAXN; s++) {
+        for (int l = 1; l <= MAXN; l++) {
+            SimResult sr = simulateRangeRaw(prices, Ns,
+                sma + (size_t)s * Ns, sma + (size_t)l * Ns, startIdx, endIdx);
+            results[k++] = { s, l, sr.finalCapital, sr.tradeCount, sr.metrics };
+            if (sr.finalCapital > out.best.finalCapital) out.best = results[k - 1];
+        }
+
+        // 定期 checkpoint：排不進前 topN 的之後也不可能進，直接丟掉
+        if (!partFile.empty() && s < MAXN && (s - firstS + 1) % g_opt.checkpointRows == 0) {
+            int keep = min(rows, k);
+            partial_sort(results, results + keep, results + k, betterResult);
+            k = keep;
+            savePartialCheckpoint(partFile, s + 1, results, k, out.best, topN);
+        }
+    }
+
+    if (!g_opt.paretoKeys.empty()) out.pareto = paretoFront(results, k, out.paretoMembers);
+
+    // 只需要前 topN 名：betterResult 是全序，partial_sort 的前段跟完整 sort 一樣
+    int keep = min(rows, k);
+    partial_sort(results, results + keep, results + k, betterResult);
+    out.top.assign(results, results + keep);
+
+    if (!ckFile.empty()) {
+        saveResultCache(ckFile, out.top, out.best, topN);
+        error_code ec;
+        filesystem::remove(partFile, ec);
+    }
+}
+
+// --------------------------------------------------
+// 依原本的順序把一檔的結果印出來、寫進 CSV（必要時存快取）
+// --------------------------------------------------
+void emitSymbolRank(const string& symbol, SymbolRank& r, ofstream& fout,
+    bool isFirstSymbol, int topN)
+{
+    if (!r.error.empty()) {
+        cerr << r.error << "\n";
+        return;
+    }
+
+    cout << "\n=== Symbol: " << symbol << " ===\n";
+    cout << "區間起訖 index: " << r.startIdx << " ~ " << r.endIdx << "\n";
+    cout << "區間交易天數: " << (r.endIdx - r.startIdx + 1) << "\n";
+    if (r.fromCache) cout << "快取命中: " << r.cacheFile << "\n";
+    if (r.fromCheckpoint) cout << "checkpoint：上次已完成\n";
+    if (r.resumedAtS > 0) cout << "checkpoint：從 s=" << r.resumedAtS << " 接著算\n";
+
+    reportAndAppend(r.top, r.best, symbol, fout, isFirstSymbol, topN);
+
+    // --pareto：整個 front 接在排名後面（console 只印筆數）
+    if (!g_opt.paretoKeys.empty()) {
+        cout << "Pareto front（" << paretoKeyList() << "）：" << r.pareto.size() << " 個點、"
+            << r.paretoMembers << " 組\n";
+        fout << symbol << " pareto " << paretoKeyList() << ",,,,,\n\n";
+        writeRankRows(fout, r.pareto, (int)r.pareto.size());
+        fout << "\n";
+    }
+
+    // --costs：每個成本情境接在後面各一段
+    for (size_t c = 0; c < r.costTop.size(); ++c) {
+        reportAndAppend(r.costTop[c], r.costBest[c], symbol + " " + costLabel(g_opt.costScenarios[c]),
+            fout, false, topN);
+    }
+
+    // 有開快取、這次是重算的，就把排序後的前 topN 名存起來
+    if (!r.fromCache && !r.cacheFile.empty()) {
+        saveResultCache(r.cacheFile, r.top, r.best, topN);
+    }
+}
+
+// ==================================================
+// Benchmark 模式（--bench）
+//   拿第一個 symbol、目前的區間，比較各 engine / 分塊大小的耗時，
+//   Linux 上另外用 perf_event 讀硬體 cache miss（沒權限就顯示 N/A），
+//   並檢查每個 engine 的結果跟 scan 完全一樣（bnb 比排序後的前 N 名，排序依 --sort），
+//   有任何不一致就回傳 1，可以當 engine 的回歸檢查（例如 --bench --sort trades）。
+// ==================================================
+#ifdef __linux__
+// 開一個只算 user space 的 cache miss 計數器；失敗回傳 -1
+int openCacheMissCounter() {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+struct BenchSample {
+    double ms;
+    long long cacheMisses;   // -1：量不到
+};
+
+BenchSample measure(const function<void()>& fn) {
+    long long misses = -1;
+#ifdef __linux__
+    int fd = openCacheMissCounter();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    auto t0 = chrono::steady_clock::now();
+    fn();
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != (ssize_t)sizeof(misses)) misses = -1;
+        close(fd);
+    }
+#endif
+    return { ms, misses };
+}
+
+int runBenchmark() {
+    const string& symbol = g_opt.symbols.front();
+    int symIdx = findSymbolIndex(symbol);
+    int startIdx = 0, endIdx = 0;
+    if (symIdx == -1 || !findDateRange(g_dateKeys, g_opt.fromKey, g_opt.toKey, startIdx, endIdx)) {
+        cerr << "找不到 " << symbol << " 或區間內沒有資料\n";
+        return 1;
+    }
+
+    vector<double> prices = extractPrices(symIdx);
+    vector<vector<double>> allSMA = calcAllSMA(prices);
+
+    vector<BruteResult> reference;
+    auto sameAsReference = [&](vector<BruteResult> r) {
+        if (r.size() != reference.size()) {
+            // bnb 只保留可能進前 N 名的組合：比對排序後的前 N 名
+            sortResults(r);
+            vector<BruteResult> ref = reference;
+            sortResults(ref);
+            for (int i = 0; i < g_opt.topN && i < (int)ref.size(); ++i) {
+                if (i >= (int)r.size() || r[i].s != ref[i].s || r[i].l != ref[i].l
+                    || r[i].finalCapital != ref[i].finalCapital) return false;
+            }
+            return true;
+        }
+        for (size_t i = 0; i < r.size(); ++i) {
+            if (r[i].s != reference[i].s || r[i].l != reference[i].l
+                || r[i].finalCapital != reference[i].finalCapital
+                || r[i].trades != reference[i].trades) return false;
+        }
+        return true;
+    };
+
+    bool allSame = true;
+    auto report = [&allSame](const string& name, const BenchSample& b, bool same) {
+        allSame = allSame && same;
+        cout << left << setw(24) << name << right << fixed << setprecision(1)
+            << setw(10) << b.ms << " ms  ";
+        if (b.cacheMisses >= 0) cout << setw(14) << b.cacheMisses << " misses";
+        else cout << setw(14) << "N/A" << " misses";
+        cout << (same ? "" : "  ★ 結果不一致") << "\n";
+    };
+
+    cout << "\n=== Benchmark: " << symbol << " index " << startIdx << " ~ " << endIdx
+        << "（" << (endIdx - startIdx + 1) << " 天）===\n";
+
+    BenchSample b = measure([&]() { reference = runGridScan(prices, allSMA, startIdx, endIdx); });
+    report("scan", b, true);
+
+    vector<BruteResult> r;
+    b = measure([&]() { r = runGridDedupe(prices, allSMA, startIdx, endIdx); });
+    report("dedupe", b, sameAsReference(r));
+
+    b = measure([&]() { r = runGridBnB(prices, allSMA, startIdx, endIdx, g_opt.topN); });
+    report("bnb (top " + to_string(g_opt.topN) + ")", b, sameAsReference(r));
+
+    b = measure([&]() { r = runGridBatched(prices, calcDayMajorSMA(prices), startIdx, endIdx); });
+    report("batched (day-major)", b, sameAsReference(r));
+
+    for (int pb : TILE_PAIR_CANDIDATES) {
+        for (int db : TILE_DAY_CANDIDATES) {
+            b = measure([&]() { r = runGridTiled(prices, allSMA, startIdx, endIdx, { pb, db }); });
+            report("tiled " + to_string(pb) + "x" + to_string(db), b, sameAsReference(r));
+        }
+    }
+
+    // 全部 symbol x 全部 period 的 SMA：逐檔 calcSMA vs 橫截面
+    vector<int> cols(g_symbols.size());
+    for (int k = 0; k < (int)cols.size(); ++k) cols[k] = k;
+    vector<vector<double>> series;
+    for (int k : cols) series.push_back(extractPrices(k));
+    vector<double> px = gatherCrossSection(cols);
+
+    cout << "\n=== SMA 1.." << MAXN << "，" << cols.size() << " 檔 ===\n";
+    volatile double sink = 0.0;   // 避免結果被整個最佳化掉
+    b = measure([&]() {
+        for (int n = 1; n <= MAXN; n++)
+            for (const auto& p : series) sink = sink + calcSMA(p, n).back();
+    });
+    report("calcSMA per symbol", b, true);
+    b = measure([&]() {
+        for (int n = 1; n <= MAXN; n++)
+            sink = sink + calcSMACrossSectional(px, (int)cols.size(), n).back();
+    });
+    report("cross-sectional", b, true);
+
+    if (!allSame) {
+        cerr << "有 engine 的結果跟 scan 不一致\n";
+        return 1;
+    }
+    return 0;
+}
+
+// ==================================================
+// 全市場篩選（--screen s,l）
+//   同一組 (s,l) 套到檔案裡每一檔 symbol 上：不逐檔呼叫 simulateWithCapitalRange，
+//   而是用橫截面 SMA（calcSMACrossSectional）一天讀一列所有 symbol 的 SMA，
+//   現金/股數/交易次數也是一個 symbol 一格的連續陣列，一天推進全部 symbol。
+//   規則同 simulateWithCapitalRange，每檔結果跟逐檔模擬完全一樣。
+//   輸出：sma_screen.csv（每檔一列 + 全市場彙總）
+// ==================================================
+vector<SimResult> simulateCrossSectional(
+    const vector<double>& px,       // [day * W + k] 價格
+    const vector<double>& smaS,     // [day * W + k] 短期 SMA
+    const vector<double>& smaL,     // [day * W + k] 長期 SMA
+    int W,
+    int startIdx,
+    int endIdx
+) {
+    int N = W > 0 ? (int)(px.size() / W) : 0;
+    vector<PairState> state(W, PairState{ INITIAL, 0, 0 });
+
+    if (startIdx < 0) startIdx = 0;
+    if (endIdx >= N) endIdx = N - 1;
+    if (N > 0 && startIdx < endIdx) {
+        if (startIdx < 1) startIdx = 1;
+
+        for (int i = startIdx; i <= endIdx; ++i) {
+            const double* sPrev = &smaS[(size_t)(i - 1) * W];
+            const double* lPrev = &smaL[(size_t)(i - 1) * W];
+            const double* sNow = &smaS[(size_t)i * W];
+            const double* lNow = &smaL[(size_t)i * W];
+            const double* price = &px[(size_t)i * W];
+            const bool isFirstDay = (i == startIdx);
+
+            for (int k = 0; k < W; ++k) {
+                int sig = crossSignal(sPrev[k] - lPrev[k], sNow[k] - lNow[k]);
+                if (sig == 0) continue;
+
+                SimBook<DefaultRules> book = state[k].book();
+                book.onCross(sig > 0, sig < 0, isFirstDay, price[k], NO_COST);
+                state[k].store(book);
+            }
+        }
+
+        // 區間最後一天強制平倉
+        const double* last = &px[(size_t)endIdx * W];
+        for (int k = 0; k < W; ++k) {
+            SimBook<DefaultRules> book = state[k].book();
+            if (book.qty != 0) book.close(last[k], NO_COST);
+            state[k].store(book);
+        }
+    }
+
+    vector<SimResult> out(W);
+    for (int k = 0; k < W; ++k) out[k] = { state[k].cash, state[k].trades };
+    return out;
+}
+
+int runScreen() {
+    int startIdx = 0, endIdx = 0;
+    if (!findDateRange(g_dateKeys, g_opt.fromKey, g_opt.toKey, startIdx, endIdx)) {
+        cerr << "區間內沒有資料\n";
+        return 1;
+    }
+
+    const int s = g_opt.screenS;
+    const int l = g_opt.screenL;
+    const int W = (int)g_symbols.size();
+    vector<int> cols(W);
+    for (int k = 0; k < W; ++k) cols[k] = k;
+
+    auto t0 = chrono::steady_clock::now();
+    vector<double> px = gatherCrossSection(cols);
+    vector<double> smaS = calcSMACrossSectional(px, W, s);
+    vector<double> smaL = calcSMACrossSectional(px, W, l);
+    vector<SimResult> res = simulateCrossSectional(px, smaS, smaL, W, startIdx, endIdx);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+    ofstream fout("sma_screen.csv");
+    if (!fout.is_open()) {
+        cerr << "無法開啟輸出檔案 sma_screen.csv\n";
+        return 1;
+    }
+    fout << "股票,最終獲利,報酬率,交易次數\n\n";
+
+    // 全市場彙總：平均/中位數報酬、賺錢檔數、最好/最差、等權重組合
+    vector<double> rets(W);
+    double sumCapital = 0.0;
+    int positive = 0, totalTrades = 0, bestK = 0, worstK = 0;
+    for (int k = 0; k < W; ++k) {
+        rets[k] = (res[k].finalCapital / INITIAL - 1.0) * 100.0;
+        sumCapital += res[k].finalCapital;
+        totalTrades += res[k].tradeCount;
+        if (rets[k] > 0) positive++;
+        if (rets[k] > rets[bestK]) bestK = k;
+        if (rets[k] < rets[worstK]) worstK = k;
+
+        fout << g_symbols[k] << fixed << setprecision(4)
+            << ",'" << res[k].finalCapital
+            << ",'" << rets[k]
+            << "," << res[k].tradeCount << "\n";
+    }
+    vector<double> sorted = rets;
+    sort(sorted.begin(), sorted.end());
+    double median = W == 0 ? 0.0
+        : (W % 2 ? sorted[W / 2] : (sorted[W / 2 - 1] + sorted[W / 2]) / 2.0);
+    double meanCapital = W == 0 ? INITIAL : sumCapital / W;
+    double meanRet = (meanCapital / INITIAL - 1.0) * 100.0;
+
+    fout << "\n";
+    fout << "等權重平均,'" << meanCapital << ",'" << meanRet << "," << totalTrades << "\n";
+    fout << "報酬率中位數,,'" << median << ",\n";
+    fout << "賺錢檔數," << positive << "/" << W << ",,\n";
+    if (W > 0) {
+        fout << "最好," << g_symbols[bestK] << ",'" << rets[bestK] << ",\n";
+        fout << "最差," << g_symbols[worstK] << ",'" << rets[worstK] << ",\n";
+    }
+
+    cout << "\n=== 全市場篩選 short=" << s << " long=" << l << " ===\n";
+    cout << "檔數: " << W << "  區間: " << g_data[startIdx].date << " ~ " << g_data[endIdx].date
+        << "  耗時: " << fixed << setprecision(1) << ms << " ms\n";
+    cout << setprecision(4) << "平均報酬率: " << meanRet << "%  中位數: " << median
+        << "%  賺錢: " << positive << "/" << W << "\n";
+    cout << "\n全部完成，輸出檔：sma_screen.csv\n";
+    return 0;
+}
+
+// ==================================================
+// Walk-forward 模式（--walk-forward）
+//   在訓練區間（--train-months 個月）挑出最佳 (s,l)，拿去跑接下來的
+//   測試區間（--test-months 個月），然後整個往後挪一個月，一直滾到資料結尾。
+//   每檔 symbol 的 allSMA 只算一次，所有視窗共用（唯讀），
+//   視窗之間互不相關，用 parallelFor 平行跑。
+//   輸出：sma_walkforward.csv（每檔一段）
+// ==================================================
+struct WalkWindow {
+    int trainStart, trainEnd;   // 訓練區間 index（含）
+    int testStart, testEnd;     // 測試區間 index（含）
+};
+
+struct WalkResult {
+    BruteResult train;          // 訓練區間的最佳組合
+    SimResult test;             // 同一組在測試區間的結果
+};
+
+const char* WALK_HEADER = "訓練起,訓練迄,測試起,測試迄,短期,長期,訓練獲利,測試獲利,測試報酬率,測試交易次數";
+
+// --------------------------------------------------
+// 訓練區間裡的最佳組合（排序規則同 betterResult）
+// --------------------------------------------------
+BruteResult bestPairInRange(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    int startIdx,
+    int endIdx
+) {
+    vector<BruteResult> results = runGrid(prices, allSMA, startIdx, endIdx, 1);
+    return *min_element(results.begin(), results.end(), betterResult);
+}
+
+// --------------------------------------------------
+// 依日曆月切出所有 walk-forward 視窗（每次往後挪一個月）
+// --------------------------------------------------
+vector<WalkWindow> buildWalkWindows(const vector<int>& dateKeys, int trainMonths, int testMonths) {
+    // 每個月第一個交易日的 index，最後補一個結尾
+    vector<int> monthStart;
+    for (int i = 0; i < (int)dateKeys.size(); ++i) {
+        if (i == 0 || dateKeys[i] / 100 != dateKeys[i - 1] / 100) monthStart.push_back(i);
+    }
+    monthStart.push_back((int)dateKeys.size());
+
+    vector<WalkWindow> windows;
+    int months = (int)monthStart.size() - 1;
+    for (int m = 0; m + trainMonths + testMonths <= months; ++m) {
+        WalkWindow w;
+        w.trainStart = monthStart[m];
+        w.trainEnd = monthStart[m + trainMonths] - 1;
+        w.testStart = monthStart[m + trainMonths];
+        w.testEnd = monthStart[m + trainMonths + testMonths] - 1;
+        windows.push_back(w);
+    }
+    return windows;
+}
+
+// --------------------------------------------------
+// 一個視窗：訓練區間找最佳組合，再拿去跑測試區間
+// --------------------------------------------------
+WalkResult runWalkWindow(const vector<double>& prices, const vector<vector<double>>& allSMA,
+    const WalkWindow& w)
+{
+    WalkResult r;
+    r.train = bestPairInRange(prices, allSMA, w.trainStart, w.trainEnd);
+    r.test = simulateWithCapitalRange(
+        prices, allSMA[r.train.s], allSMA[r.train.l], w.testStart, w.testEnd);
+    return r;
+}
+
+// --------------------------------------------------
+// 寫一檔的 walk-forward 段落（本機模式 / coordinator 共用）
+// --------------------------------------------------
+void writeWalkForwardSection(const string& symbol, const vector<WalkWindow>& windows,
+    const vector<WalkResult>& results, ofstream& fout)
+{
+    // 樣本外串接：每個測試區間的報酬率連乘（只在測試區間不重疊時有意義）
+    double chained = INITIAL;
+    fout << symbol << ",,,,,,,,,\n";
+    for (size_t k = 0; k < windows.size(); ++k) {
+        const WalkWindow& w = windows[k];
+        const WalkResult& r = results[k];
+        double testRet = (r.test.finalCapital / INITIAL - 1.0) * 100.0;
+        chained *= r.test.finalCapital / INITIAL;
+
+        std::ostringstream row;
+        row << std::fixed << std::setprecision(4)
+            << g_data[w.trainStart].date << "," << g_data[w.trainEnd].date << ","
+            << g_data[w.testStart].date << "," << g_data[w.testEnd].date << ","
+            << r.train.s << "," << r.train.l << ","
+            << "'" << r.train.finalCapital << ","
+            << "'" << r.test.finalCapital << ","
+            << "'" << testRet << ","
+            << r.test.tradeCount << "\n";
+        fout << row.str();
+    }
+    double chainedRet = (chained / INITIAL - 1.0) * 100.0;
+    fout << "樣本外串接,,,,,,,'" << fixed << setprecision(4) << chained
+        << ",'" << chainedRet << ",\n\n";
+
+    cout << "\n==== " << symbol << " walk-forward ====\n";
+    cout << "視窗數: " << windows.size()
+        << "  樣本外串接資金: " << fixed << setprecision(4) << chained
+        << " (" << chainedRet << "%)\n";
+}
+
+void runWalkForwardForSymbol(const string& symbol, const vector<WalkWindow>& windows,
+    int workers, ofstream& fout)
+{
+    int symIdx = findSymbolIndex(symbol);
+    if (symIdx == -1) {
+        cerr << "找不到 symbol: " << symbol << "\n";
+        return;
+    }
+
+    vector<double> prices = extractPrices(symIdx);
+    vector<vector<double>> allSMA = calcAllSMA(prices);   // 所有視窗共用
+
+    vector<WalkResult> results(windows.size());
+    parallelFor((int)windows.size(), [&](int k) {
+        results[k] = runWalkWindow(prices, allSMA, windows[k]);
+    }, workers);
+
+    writeWalkForwardSection(symbol, windows, results, fout);
+}
+
+int runWalkForward() {
+    vector<WalkWindow> windows = buildWalkWindows(g_dateKeys, g_opt.trainMonths, g_opt.testMonths);
+    if (windows.empty()) {
+        cerr << "資料長度不足以切出任何 walk-forward 視窗\n";
+        return 1;
+    }
+    cout << "walk-forward：訓練 " << g_opt.trainMonths << " 個月、測試 "
+        << g_opt.testMonths << " 個月，共 " << windows.size() << " 個視窗\n";
+
+    ofstream fout("sma_walkforward.csv");
+    if (!fout.is_open()) {
+        cerr << "無法開啟輸出檔案 sma_walkforward.csv\n";
+        return 1;
+    }
+    fout << WALK_HEADER << "\n\n";
+
+    // 每個視窗的暫存：跟一檔 symbol 差不多，只是 allSMA 共用不用另外算
+    size_t smaBytes = (MAXN + 1) * g_data.size() * sizeof(double);
+    size_t taskBytes = estimateTaskBytes();
+    int workers = admittedWorkers(taskBytes > smaBytes ? taskBytes - smaBytes : taskBytes);
+
+    for (const auto& sym : g_opt.symbols) {
+        runWalkForwardForSymbol(sym, windows, workers, fout);
+    }
+    reportPeakRss();
+
+    cout << "\n全部完成，輸出檔：sma_walkforward.csv\n";
+    return 0;
+}
+
+// ==================================================
+// Coordinator / worker 模式（檔案佇列，跑 walk-forward）
+//   --coordinate <dir> [--spawn N] [--retries R] [--lease-sec S]
+//   --worker <dir>
+//   工作 = (symbol, walk-forward 視窗)，一個工作一個檔案，狀態靠所在的目錄區分：
+//     pending/  等人領；worker 用 rename 搬到 running/ 來領，同一個檔只有一個人搬得到
+//     running/  執行中；mtime 是領取時間，超過 lease 還沒做完就當作 worker 掛了
+//     done/     結果（先寫 .tmp 再 rename，不會讀到半個檔）
+//     failed/   失敗；coordinator 重新排進 pending，超過 --retries 次就放棄
+//   spec 記錄資料指紋與視窗設定：worker 資料對不上就不接工作，
+//   coordinator 遇到別的設定留下的目錄也會拒絕。
+//   同一個目錄重跑會沿用 done/ 裡的結果。收齊之後寫 sma_walkforward.csv
+//   （格式同 --walk-forward），再建立 finished 讓 worker 離開。
+//   多台機器共用檔案系統時，各台自己跑 --worker 即可；--spawn 只是本機 fork 幾個。
+// ==================================================
+struct QueueJob {
+    string symbol;
+    int window = 0;
+    WalkWindow w{};
+    int attempts = 0;
+};
+
+const char* QUEUE_DIRS[] = { "pending", "running", "done", "failed" };
+
+string queueJobName(int id) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%06d.job", id);
+    return buf;
+}
+
+// 資料指紋：symbol、日期、價格全部雜湊，worker 跟 coordinator 讀的必須是同一份
+string queueDataFingerprint() {
+    Fnv64 h;
+    for (const auto& sym : g_symbols) h.add(sym);
+    for (const auto& d : g_data) {
+        h.add(d.date);
+        h.add(d.prices.data(), d.prices.size() * sizeof(double));
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016llx", h.h);
+    return buf;
+}
+
+// 均線種類、成交規則也要一致（都是預設時不寫，維持舊的 spec 格式）
+string queueRulesLine() {
+    if (g_opt.indicator == Indicator::SMA && !customRules()) return "";
+    return "rules=" + strategyTag() + "\n";
+}
 
-        fout << (i + 1) << ","     // 排名（數字）
-            << r.s << ","         // 短期
-            << r.l << ","         // 長期
-            << capField << ","    // 最終獲利（文字）
-            << retField << ","    // 報酬率（文字）
-            << r.trades << "\n";  // 交易次數（數字）
+string queueSpec() {
+    ostringstream ss;
+    ss << "data=" << queueDataFingerprint() << "\n"
+        << queueRulesLine()
+        << "windows=" << g_opt.trainMonths << "x" << g_opt.testMonths << "\n"
+        << "symbols=";
+    for (size_t j = 0; j < g_opt.symbols.size(); ++j) ss << (j ? "," : "") << g_opt.symbols[j];
+    ss << "\n";
+    return ss.str();
+}
+
+bool readTextFile(const string& path, string& text) {
+    ifstream in(path, ios::binary);
+    if (!in.is_open()) return false;
+    ostringstream ss;
+    ss << in.rdbuf();
+    text = ss.str();
+    return true;
+}
+
+// 先寫 .tmp 再 rename 到目的地（同一個檔案系統內是原子的）
+bool writeTextAtomic(const string& path, const string& text) {
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp, ios::binary);
+        if (!out.is_open()) return false;
+        out << text;
+        if (!out) return false;
+    }
+    error_code ec;
+    filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+string formatJob(const QueueJob& job) {
+    ostringstream ss;
+    ss << job.symbol << "\n"
+        << job.window << " " << job.w.trainStart << " " << job.w.trainEnd << " "
+        << job.w.testStart << " " << job.w.testEnd << " " << job.attempts << "\n";
+    return ss.str();
+}
+
+bool parseJob(const string& text, QueueJob& job) {
+    istringstream ss(text);
+    return getline(ss, job.symbol) && !job.symbol.empty()
+        && (ss >> job.window >> job.w.trainStart >> job.w.trainEnd
+            >> job.w.testStart >> job.w.testEnd >> job.attempts);
+}
+
+string formatWalkResult(const WalkResult& r) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%d %d %.17g %.17g %d\n",
+        r.train.s, r.train.l, r.train.finalCapital, r.test.finalCapital, r.test.tradeCount);
+    return buf;
+}
+
+bool parseWalkResult(const string& text, WalkResult& r) {
+    r.train.trades = 0;
+    return sscanf(text.c_str(), "%d %d %lf %lf %d", &r.train.s, &r.train.l,
+        &r.train.finalCapital, &r.test.finalCapital, &r.test.tradeCount) == 5;
+}
+
+// 目錄裡的檔名（排序過，略過寫到一半的 .tmp）
+vector<string> listQueueDir(const string& dir) {
+    vector<string> names;
+    error_code ec;
+    for (filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        string name = it->path().filename().string();
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) continue;
+        names.push_back(name);
+    }
+    sort(names.begin(), names.end());
+    return names;
+}
+
+// 把 running/ 裡的工作搬到 failed/，附上原因
+void failQueueJob(const string& dir, const string& name, const string& reason) {
+    // running/ 裡已經沒有了（lease 逾時被 coordinator 收回）：不要留一個只有 error= 的空殼
+    string text;
+    if (!readTextFile(dir + "/running/" + name, text)) return;
+    writeTextAtomic(dir + "/failed/" + name, text + "error=" + reason + "\n");
+    error_code ec;
+    filesystem::remove(dir + "/running/" + name, ec);
+}
+
+int runWorker(const string& dir) {
+    string spec;
+    if (!readTextFile(dir + "/spec", spec)) {
+        cerr << "佇列目錄還沒建立（先啟動 --coordinate）: " << dir << "\n";
+        return 1;
+    }
+    if (spec.compare(0, spec.find('\n'), "data=" + queueDataFingerprint()) != 0) {
+        cerr << "worker 的資料檔跟 coordinator 的不一樣，不接工作\n";
+        return 1;
+    }
+    string rulesLine = queueRulesLine();
+    bool rulesOk = rulesLine.empty() ? spec.find("\nrules=") == string::npos
+        : spec.find("\n" + rulesLine) != string::npos;
+    if (!rulesOk) {
+        cerr << "worker 的 --indicator / 成交規則跟 coordinator 的不一樣，不接工作\n";
+        return 1;
+    }
+
+    // 連續領到同一檔時 allSMA 不用重算
+    string curSymbol;
+    vector<double> prices;
+    vector<vector<double>> allSMA;
+    int finished = 0;
+    const int N = (int)g_data.size();
+
+    for (;;) {
+        string name;
+        error_code ec;
+        for (const auto& cand : listQueueDir(dir + "/pending")) {
+            // lease 從領工作的時間算：rename 不會改 mtime，先 touch 再搬，
+            // 不然在 pending/ 放太久的工作一搬進 running/ 就會被當成逾時
+            string from = dir + "/pending/" + cand;
+            filesystem::last_write_time(from, filesystem::file_time_type::clock::now(), ec);
+            if (ec) continue;
+            filesystem::rename(from, dir + "/running/" + cand, ec);
+            if (!ec) {
+                name = cand;
+                break;
+            }
+        }
+        if (name.empty()) {
+            if (filesystem::exists(dir + "/finished")) break;
+            this_thread::sleep_for(chrono::milliseconds(200));
+            continue;
+        }
+
+        // 逾時重排的工作原本的 worker 後來還是做完了：不用再算一次
+        if (filesystem::exists(dir + "/done/" + name)) {
+            filesystem::remove(dir + "/running/" + name, ec);
+            continue;
+        }
+
+        QueueJob job;
+        string text;
+        if (!readTextFile(dir + "/running/" + name, text) || !parseJob(text, job)) {
+            failQueueJob(dir, name, "工作檔格式錯誤");
+            continue;
+        }
+        int symIdx = findSymbolIndex(job.symbol);
+        if (symIdx == -1 || job.w.trainStart < 0 || job.w.testEnd >= N) {
+            failQueueJob(dir, name, "symbol 或視窗不在資料範圍內");
+            continue;
+        }
+
+        try {
+            if (job.symbol != curSymbol) {
+                prices = extractPrices(symIdx);
+                allSMA = calcAllSMA(prices);
+                curSymbol = job.symbol;
+            }
+            WalkResult r = runWalkWindow(prices, allSMA, job.w);
+            if (!writeTextAtomic(dir + "/done/" + name, formatWalkResult(r))) {
+                failQueueJob(dir, name, "無法寫入結果");
+                continue;
+            }
+        }
+        catch (const exception& e) {
+            failQueueJob(dir, name, e.what());
+            continue;
+        }
+        filesystem::remove(dir + "/running/" + name, ec);
+        ++finished;
+    }
+
+    cout << "worker 結束，完成 " << finished << " 個工作\n";
+    return 0;
+}
+
+int runCoordinator(const string& dir) {
+    vector<WalkWindow> windows = buildWalkWindows(g_dateKeys, g_opt.trainMonths, g_opt.testMonths);
+    if (windows.empty()) {
+        cerr << "資料長度不足以切出任何 walk-forward 視窗\n";
+        return 1;
+    }
+
+    error_code ec;
+    for (const char* sub : QUEUE_DIRS) filesystem::create_directories(dir + "/" + sub, ec);
+    if (ec) {
+        cerr << "無法建立佇列目錄: " << dir << "\n";
+        return 1;
+    }
+    string spec = queueSpec(), oldSpec;
+    if (readTextFile(dir + "/spec", oldSpec)) {
+        if (oldSpec != spec) {
+            cerr << "佇列目錄是別的資料 / 設定留下的，換一個目錄或先清掉: " << dir << "\n";
+            return 1;
+        }
+    }
+    else if (!writeTextAtomic(dir + "/spec", spec)) {
+        cerr << "無法寫入 " << dir << "/spec\n";
+        return 1;
+    }
+    filesystem::remove(dir + "/finished", ec);
+
+    // 排工作：已經在任何一個狀態目錄裡的就不重排（沿用上次的進度）
+    vector<string> symbols;
+    for (const auto& sym : g_opt.symbols) {
+        if (findSymbolIndex(sym) == -1) cerr << "找不到 symbol: " << sym << "\n";
+        else symbols.push_back(sym);
+    }
+    const int W = (int)windows.size();
+    const int total = (int)symbols.size() * W;
+    for (int id = 0; id < total; ++id) {
+        string name = queueJobName(id);
+        bool known = false;
+        for (const char* sub : QUEUE_DIRS) known = known || filesystem::exists(dir + "/" + sub + "/" + name);
+        if (known) continue;
+
+        QueueJob job;
+        job.symbol = symbols[id / W];
+        job.window = id % W;
+        job.w = windows[id % W];
+        // 先寫在根目錄再搬進 pending，worker 不會看到寫一半的檔
+        string staged = dir + "/" + name;
+        if (!writeTextAtomic(staged, formatJob(job))) {
+            cerr << "無法寫入工作檔: " << staged << "\n";
+            return 1;
+        }
+        filesystem::rename(staged, dir + "/pending/" + name, ec);
+    }
+    cout << "coordinator：" << symbols.size() << " 檔 × " << W << " 個視窗 = " << total << " 個工作\n";
+
+#ifndef _WIN32
+    // 本機 worker：fork 出來直接共用已經讀好的資料
+    vector<pid_t> children;
+    for (int k = 0; k < g_opt.spawnWorkers; ++k) {
+        cout.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            int rc = runWorker(dir);
+            cout.flush();
+            _exit(rc);
+        }
+        if (pid > 0) children.push_back(pid);
+        else cerr << "fork 失敗，少開一個 worker\n";
+    }
+#else
+    if (g_opt.spawnWorkers > 0) cerr << "Windows 上不支援 --spawn，請另外啟動 --worker\n";
+#endif
+
+    // 等結果：處理失敗重試、lease 逾時
+    const auto lease = chrono::seconds(g_opt.leaseSec);
+    int gaveUp = 0, lastDone = -1;
+    set<string> badReported;    // 已經報過無法解析的 failed/ 檔
+    for (;;) {
+        for (const auto& name : listQueueDir(dir + "/running")) {
+            // 結果已經寫好、worker 還沒來得及清掉 running/ 的不算逾時
+            if (filesystem::exists(dir + "/done/" + name)) continue;
+            auto mtime = filesystem::last_write_time(dir + "/running/" + name, ec);
+            if (!ec && filesystem::file_time_type::clock::now() - mtime > lease) {
+                failQueueJob(dir, name, "lease 逾時");
+            }
+        }
+
+        gaveUp = 0;
+        for (const auto& name : listQueueDir(dir + "/failed")) {
+            int id = atoi(name.c_str());
+            if (name != queueJobName(id) || id < 0 || id >= total) continue;   // 不是這次的工作
+            if (filesystem::exists(dir + "/done/" + name)) {
+                filesystem::remove(dir + "/failed/" + name, ec);
+                continue;
+            }
+
+            QueueJob job;
+            string text;
+            if (!readTextFile(dir + "/failed/" + name, text) || !parseJob(text, job)) {
+                // 檔案壞掉：從編號重建工作，只剩最後一次機會（不知道之前試過幾次）
+                job = QueueJob();
+                job.symbol = symbols[id / W];
+                job.window = id % W;
+                job.w = windows[id % W];
+                job.attempts = max(g_opt.retries - 1, 0);
+                if (job.attempts >= g_opt.retries && badReported.insert(name).second) {
+                    cerr << "無法解析 " << dir << "/failed/" << name << "，放棄這個工作\n";
+                }
+            }
+            if (job.attempts >= g_opt.retries) {
+                ++gaveUp;
+                continue;
+            }
+            ++job.attempts;
+            size_t errPos = text.rfind("error=");
+            cerr << "重試 " << job.symbol << " 視窗 " << job.window << "（第 " << job.attempts << " 次）："
+                << (errPos == string::npos ? "工作檔無法解析\n" : text.substr(errPos + 6));
+            string staged = dir + "/" + name;
+            if (writeTextAtomic(staged, formatJob(job))) {
+                filesystem::rename(staged, dir + "/pending/" + name, ec);
+                filesystem::remove(dir + "/failed/" + name, ec);
+            }
+        }
+
+        int done = (int)listQueueDir(dir + "/done").size();
+        if (done != lastDone) {
+            cout << "進度: " << done << " / " << total << "\n";
+            lastDone = done;
+        }
+        if (done + gaveUp >= total) break;
+
+#ifndef _WIN32
+        // 自己開的 worker 全部不見了就別空等（沒開的話假設外面有 worker）
+        if (!children.empty()) {
+            bool anyAlive = false;
+            for (pid_t& pid : children) {
+                if (pid > 0 && waitpid(pid, nullptr, WNOHANG) == pid) pid = 0;
+                anyAlive = anyAlive || pid > 0;
+            }
+            if (!anyAlive) {
+                cerr << "worker 都已結束，但還有工作沒完成\n";
+                return 1;
+            }
+        }
+#endif
+        this_thread::sleep_for(chrono::milliseconds(200));
+    }
+
+    writeTextAtomic(dir + "/finished", "");
+#ifndef _WIN32
+    for (pid_t pid : children) {
+        if (pid > 0) waitpid(pid, nullptr, 0);
+    }
+#endif
+
+    // 收結果：依 --symbols 順序寫出，有視窗放棄的 symbol 整段跳過
+    ofstream fout("sma_walkforward.csv");
+    if (!fout.is_open()) {
+        cerr << "無法開啟輸出檔案 sma_walkforward.csv\n";
+        return 1;
+    }
+    fout << WALK_HEADER << "\n\n";
+
+    for (size_t j = 0; j < symbols.size(); ++j) {
+        vector<WalkResult> results(W);
+        bool complete = true;
+        for (int k = 0; k < W && complete; ++k) {
+            string text;
+            complete = readTextFile(dir + "/done/" + queueJobName((int)j * W + k), text)
+                && parseWalkResult(text, results[k]);
+        }
+        if (!complete) {
+            cerr << symbols[j] << " 有視窗重試 " << g_opt.retries << " 次仍失敗，略過（見 " << dir << "/failed）\n";
+            continue;
+        }
+        writeWalkForwardSection(symbols[j], windows, results, fout);
+    }
+
+    cout << "\n全部完成，輸出檔：sma_walkforward.csv\n";
+    return gaveUp > 0 ? 1 : 0;
+}
+
+// ==================================================
+// 多區間模式（--years 2014-2024 或 --years 2014,2018,2024）
+//   每一年各出一份排名，但每檔 symbol 的 allSMA 只算一次，
+//   而且每組 (s,l) 只掃一次歷史：每天的 SMA 差值 / 交叉判斷只做一次，
+//   有交叉的那天再套用到每個涵蓋這天的區間的狀態上。
+//   結果跟逐年呼叫 simulateWithCapitalRange 完全一樣。
+// ==================================================
+struct RangeSpec {
+    string label;
+    int startIdx;
+    int endIdx;
+};
+
+// --------------------------------------------------
+// 一組 (s,l) 一次掃過所有區間：回傳每個區間的 SimResult
+// --------------------------------------------------
+void simulateMultiRange(
+    const vector<double>& prices,
+    const vector<double>& smaS,
+    const vector<double>& smaL,
+    const vector<RangeSpec>& ranges,
+    vector<SimResult>& out
+) {
+    struct State {
+        int simStart;   // 實際開始模擬的 index（同 simulateWithCapitalRange 的 startIdx 修正）
+        int endIdx;
+        bool active;    // false：區間太短，直接回傳 INITIAL
+        SimBook<DefaultRules> book;
+    };
+
+    int N = (int)prices.size();
+    int W = (int)ranges.size();
+    State st[64];   // 區間數由 parseYears 限制在 64 以內
+    int firstDay = N, lastDay = -1;
+
+    for (int w = 0; w < W; ++w) {
+        int startIdx = max(ranges[w].startIdx, 0);
+        int endIdx = min(ranges[w].endIdx, N - 1);
+        st[w] = { max(startIdx, 1), endIdx, N > 0 && startIdx < endIdx, SimBook<DefaultRules>() };
+        if (st[w].active) {
+            firstDay = min(firstDay, st[w].simStart);
+            lastDay = max(lastDay, st[w].endIdx);
+        }
+    }
+
+    for (int i = firstDay; i <= lastDay; ++i) {
+        int sig = crossSignal(smaS[i - 1] - smaL[i - 1], smaS[i] - smaL[i]);
+        if (sig == 0) continue;
+
+        for (int w = 0; w < W; ++w) {
+            State& s = st[w];
+            if (!s.active || i < s.simStart || i > s.endIdx) continue;
+
+            s.book.onCross(sig > 0, sig < 0, i == s.simStart, prices[i], NO_COST);
+        }
+    }
+
+    out.resize(W);
+    for (int w = 0; w < W; ++w) {
+        State& s = st[w];
+        if (!s.active) {
+            out[w] = { INITIAL, 0 };
+            continue;
+        }
+        // 區間最後一天強制平倉
+        if (s.book.qty != 0) s.book.close(prices[s.endIdx], NO_COST);
+        out[w] = { s.book.cash, s.book.trades };
+    }
+}
+
+// --------------------------------------------------
+// 所有 (s,l) x 所有區間：回傳 results[w] = 第 w 個區間的未排序結果
+// --------------------------------------------------
+vector<vector<BruteResult>> runGridMultiRange(
+    const vector<double>& prices,
+    const vector<vector<double>>& allSMA,
+    const vector<RangeSpec>& ranges
+) {
+    vector<vector<BruteResult>> results(ranges.size());
+    for (auto& r : results) r.reserve(MAXN * MAXN);
+
+    vector<SimResult> sr;
+    for (int s = 1; s <= MAXN; s++) {
+        for (int l = 1; l <= MAXN; l++) {
+            simulateMultiRange(prices, allSMA[s], allSMA[l], ranges, sr);
+            for (size_t w = 0; w < ranges.size(); ++w) {
+                results[w].push_back({ s, l, sr[w].finalCapital, sr[w].tradeCount });
+            }
+        }
+    }
+    return results;
+}
+
+// --------------------------------------------------
+// 多區間主流程：每檔 symbol 算一次 SMA、掃一次歷史，每個區間各寫一段
+//   段落標題是「AAPL 2014」這種形式，格式同 sma_rank_all.csv
+// --------------------------------------------------
+int runMultiRange() {
+    vector<RangeSpec> ranges;
+    for (int year : g_opt.years) {
+        RangeSpec r;
+        r.label = to_string(year);
+        if (!findDateRange(g_dateKeys, year * 10000 + 101, year * 10000 + 1231, r.startIdx, r.endIdx)) {
+            cerr << "找不到 " << year << " 的資料，略過\n";
+            continue;
+        }
+        ranges.push_back(r);
+    }
+    if (ranges.empty()) {
+        cerr << "沒有任何可用的區間\n";
+        return 1;
+    }
+
+    ofstream fout("sma_rank_all.csv");
+    if (!fout.is_open()) {
+        cerr << "無法開啟輸出檔案 sma_rank_all.csv\n";
+        return 1;
+    }
+    fout << "排名,短期,長期,最終獲利,報酬率,交易次數\n\n";
+
+    bool first = true;
+    for (const auto& symbol : g_opt.symbols) {
+        int symIdx = findSymbolIndex(symbol);
+        if (symIdx == -1) {
+            cerr << "找不到 symbol: " << symbol << "\n";
+            continue;
+        }
+
+        vector<double> prices = extractPrices(symIdx);
+        vector<vector<double>> allSMA = calcAllSMA(prices);
+        vector<vector<BruteResult>> results = runGridMultiRange(prices, allSMA, ranges);
+
+        for (size_t w = 0; w < ranges.size(); ++w) {
+            BruteResult best = findBest(results[w]);
+            reportAndAppend(results[w], best, symbol + " " + ranges[w].label,
+                fout, first, g_opt.topN);
+            first = false;
+        }
+    }
+
+    cout << "\n全部完成，輸出檔：sma_rank_all.csv\n";
+    return 0;
+}
+
+// ==================================================
+// 增量更新模式（--incremental <state file>）
+//   資料檔尾端多了新的交易日時，不重讀整個檔、不重算 SMA、不重跑 grid：
+//   checkpoint 記住「讀到第幾個 byte」、每個 period 的滾動總和、每組 (s,l)
+//   的模擬狀態（現金/股數/交易次數），新的一天只要：
+//     1. 每個 period 的 SMA 用 O(1) 更新（加新價、減掉 n 天前的價）
+//     2. 每組 (s,l) 往前推一天
+//   模擬區間：--from（預設 --year 的 1/1）一直到最新一天，
+//   排名時把持股用最新一天收盤價「虛擬平倉」，跟 simulateWithCapitalRange
+//   以最新一天當 endIdx 的結果完全一樣。
+//   checkpoint 不存在時，從頭讀一次資料檔建立；checkpoint 的 --symbols、--from
+//   或資料檔 header 跟這次不一樣時，也從頭重建（不沿用別的設定的狀態）。
+// ==================================================
+
+// 一檔 symbol 的增量狀態
+struct IncSymbol {
+    string symbol;
+    int column = 0;             // 在資料檔裡的欄位（0 是 Date）
+    vector<double> ring;        // 最近 MAXN 天的價格（環狀，第 i 天放在 i % MAXN）
+    vector<double> sums;        // sums[n]：SMA(n) 的滾動總和（累加順序同 calcSMA）
+    vector<double> prevSMA;     // prevSMA[n]：前一天的 SMA(n)，還不夠天數就是 NaN
+    double lastPrice = 0.0;
+    vector<PairState> pairs;    // index = (s-1)*MAXN + (l-1)
+    vector<double> curSMA;      // 暫存：當天的 SMA（不存進 checkpoint，只是避免每天配置）
+};
+
+// 整個 checkpoint
+struct IncState {
+    int fromKey = 0;            // 模擬區間起點（日期 key）
+    vector<string> requested;   // 建立時的 --symbols（找不到的 symbol 不在 symbols 裡）
+    string header;              // 建立時資料檔的 header 列
+    long long fileOffset = 0;   // 資料檔已經處理到的 byte
+    int headerColumns = 0;      // header 欄位數（含 Date），用來檢查新資料列
+    int days = 0;               // 已處理天數（= 下一天的 index）
+    int startIdx = -1;          // 區間第一天的 index（-1：還沒進區間）
+    string lastDate;
+    vector<IncSymbol> symbols;
+};
+
+const char INC_MAGIC[8] = { 'S', 'M', 'A', 'I', 'N', 'C', '2', '\0' };
+
+// checkpoint 的二進位讀寫小工具
+template <typename T>
+void writePod(ostream& out, const T& v) { out.write((const char*)&v, sizeof(T)); }
+
+template <typename T>
+bool readPod(istream& in, T& v) { return (bool)in.read((char*)&v, sizeof(T)); }
+
+template <typename T>
+void writeVec(ostream& out, const vector<T>& v) {
+    writePod(out, (long long)v.size());
+    out.write((const char*)v.data(), (streamsize)(v.size() * sizeof(T)));
+}
+
+template <typename T>
+bool readVec(istream& in, vector<T>& v) {
+    long long n = 0;
+    if (!readPod(in, n) || n < 0) return false;
+    v.resize((size_t)n);
+    return (bool)in.read((char*)v.data(), (streamsize)(n * sizeof(T)));
+}
+
+void writeStr(ostream& out, const string& s) {
+    writePod(out, (int)s.size());
+    out.write(s.data(), (streamsize)s.size());
+}
+
+bool readStr(istream& in, string& s) {
+    int n = 0;
+    if (!readPod(in, n) || n < 0) return false;
+    s.resize((size_t)n);
+    return (bool)in.read(&s[0], n);
+}
+
+bool saveIncState(const IncState& st, const string& path) {
+    // 先寫暫存檔再 rename，寫到一半被砍掉也不會弄壞舊的 checkpoint
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp, ios::binary);
+        if (!out.is_open()) return false;
+        out.write(INC_MAGIC, sizeof(INC_MAGIC));
+        writePod(out, MAXN);
+        writePod(out, INITIAL);
+        writePod(out, st.fromKey);
+        writePod(out, (int)st.requested.size());
+        for (const auto& name : st.requested) writeStr(out, name);
+        writeStr(out, st.header);
+        writePod(out, st.fileOffset);
+        writePod(out, st.headerColumns);
+        writePod(out, st.days);
+        writePod(out, st.startIdx);
+        writeStr(out, st.lastDate);
+        writePod(out, (int)st.symbols.size());
+        for (const auto& sym : st.symbols) {
+            writeStr(out, sym.symbol);
+            writePod(out, sym.column);
+            writePod(out, sym.lastPrice);
+            writeVec(out, sym.ring);
+            writeVec(out, sym.sums);
+            writeVec(out, sym.prevSMA);
+            writeVec(out, sym.pairs);
+        }
+        if (!out) return false;
+    }
+#ifdef _WIN32
+    remove(path.c_str());  // Windows 的 rename 不會覆蓋既有檔案
+#endif
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool loadIncState(IncState& st, const string& path) {
+    ifstream in(path, ios::binary);
+    if (!in.is_open()) return false;
+
+    char magic[sizeof(INC_MAGIC)];
+    int maxN = 0;
+    double initial = 0.0;
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, INC_MAGIC, sizeof(magic)) != 0
+        || !readPod(in, maxN) || !readPod(in, initial)
+        || maxN != MAXN || initial != INITIAL) {
+        cerr << "checkpoint 格式不符: " << path << "\n";
+        return false;
+    }
+
+    int count = 0;
+    bool ok = readPod(in, st.fromKey) && readPod(in, count) && count >= 0;
+    st.requested.assign(ok ? count : 0, string());
+    for (auto& name : st.requested) ok = ok && readStr(in, name);
+    ok = ok && readStr(in, st.header) && readPod(in, st.fileOffset)
+        && readPod(in, st.headerColumns) && readPod(in, st.days)
+        && readPod(in, st.startIdx) && readStr(in, st.lastDate)
+        && readPod(in, count) && count >= 0;
+    st.symbols.assign(ok ? count : 0, IncSymbol());
+    for (auto& sym : st.symbols) {
+        ok = ok && readStr(in, sym.symbol) && readPod(in, sym.column)
+            && readPod(in, sym.lastPrice) && readVec(in, sym.ring)
+            && readVec(in, sym.sums) && readVec(in, sym.prevSMA)
+            && readVec(in, sym.pairs);
+    }
+    if (!ok) cerr << "checkpoint 讀取失敗: " << path << "\n";
+    return ok;
+}
+
+// --------------------------------------------------
+// 把一檔 symbol 往前推一天（第 i 天，收盤價 price；startIdx 同 IncState）
+// --------------------------------------------------
+void advanceIncSymbol(int i, int startIdx, IncSymbol& sym, double price) {
+    const double NaN = numeric_limits<double>::quiet_NaN();
+
+    // 1. 每個 period 的 SMA：跟 calcSMA 同樣的加減順序，結果逐位元相同
+    vector<double>& curSMA = sym.curSMA;
+    curSMA.assign(MAXN + 1, NaN);
+    for (int n = 1; n <= MAXN; n++) {
+        if (i < n - 1) {
+            sym.sums[n] += price;
+        }
+        else if (i == n - 1) {
+            sym.sums[n] += price;
+            curSMA[n] = sym.sums[n] / n;
+        }
+        else {
+            sym.sums[n] += price - sym.ring[(i - n) % MAXN];
+            curSMA[n] = sym.sums[n] / n;
+        }
+    }
+
+    // 2. 每組 (s,l) 往前推一天（規則同 simulateWithCapitalRange）
+    int simStart = max(startIdx, 1);
+    if (startIdx != -1 && i >= simStart) {
+        bool isFirstDay = (i == simStart);
+        for (int s = 1; s <= MAXN; s++) {
+            for (int l = 1; l <= MAXN; l++) {
+                int sig = crossSignal(sym.prevSMA[s] - sym.prevSMA[l], curSMA[s] - curSMA[l]);
+                if (sig == 0) continue;
+
+                PairState& ps = sym.pairs[(s - 1) * MAXN + (l - 1)];
+                SimBook<DefaultRules> book = ps.book();
+                book.onCross(sig > 0, sig < 0, isFirstDay, price, NO_COST);
+                ps.store(book);
+            }
+        }
+    }
+
+    sym.ring[i % MAXN] = price;
+    sym.prevSMA.swap(curSMA);
+    sym.lastPrice = price;
+}
+
+// --------------------------------------------------
+// 從 st.fileOffset 開始讀資料檔的新資料列，逐天推進所有 symbol
+//   buildNew = true：從頭建立（讀 header 決定欄位，offset 從 header 後開始）
+//   增量模式只處理有換行結尾的完整資料列，最後一列還沒寫完就留到下次；
+//   串流模式（partialLastRow = true）讀的是寫好的檔案，沒有換行結尾的最後一列照樣處理
+//   日期超過 stopAfterKey 就停（串流模式的區間終點），那一列不算處理過
+//   一次讀 INC_BLOCK_ROWS 列、各 symbol 平行推進，記憶體只跟 block 大小有關
+//   回傳新處理的天數，失敗回傳 -1
+// --------------------------------------------------
+const int INC_BLOCK_ROWS = 1024;
+
+int consumeNewRows(IncState& st, const string& filename, bool buildNew,
+    int stopAfterKey = numeric_limits<int>::max(), bool partialLastRow = false)
+{
+    ifstream fin(filename, ios::binary);
+    if (!fin.is_open()) {
+        cerr << "無法開啟檔案: " << filename << "\n";
+        return -1;
+    }
+
+    string line;
+    if (!getline(fin, line)) {
+        cerr << "檔案是空的: " << filename << "\n";
+        return -1;
+    }
+    auto headerTokens = splitCsvLine(line);
+
+    if (buildNew) {
+        st.header = line;
+        st.requested = g_opt.symbols;
+        st.headerColumns = (int)headerTokens.size();
+        st.fileOffset = (long long)fin.tellg();
+        for (const auto& name : g_opt.symbols) {
+            auto it = find(headerTokens.begin() + 1, headerTokens.end(), name);
+            if (it == headerTokens.end()) {
+                cerr << "找不到 symbol: " << name << "\n";
+                continue;
+            }
+            IncSymbol sym;
+            sym.symbol = name;
+            sym.column = (int)(it - headerTokens.begin());
+            sym.ring.assign(MAXN, 0.0);
+            sym.sums.assign(MAXN + 1, 0.0);
+            sym.prevSMA.assign(MAXN + 1, numeric_limits<double>::quiet_NaN());
+            sym.pairs.assign(MAXN * MAXN, PairState{ INITIAL, 0, 0 });
+            st.symbols.push_back(std::move(sym));
+        }
+    }
+    else {
+        // header 在 runIncremental 載入 checkpoint 時已經比對過（checkIncState）
+        fin.seekg(st.fileOffset);
+    }
+
+    // 只轉換用到的欄位：cols 遞增，slot[j] = 第 j 檔在 cols 裡的位置
+    vector<int> cols;
+    for (const auto& sym : st.symbols) cols.push_back(sym.column);
+    sort(cols.begin(), cols.end());
+    cols.erase(unique(cols.begin(), cols.end()), cols.end());
+    vector<int> slot;
+    for (const auto& sym : st.symbols) {
+        slot.push_back((int)(lower_bound(cols.begin(), cols.end(), sym.column) - cols.begin()));
+    }
+    const int C = (int)cols.size();
+
+    vector<double> block;       // 列 × C
+    block.reserve((size_t)INC_BLOCK_ROWS * C);
+    vector<double> rowPrices;
+    string date;
+    int rows = 0, added = 0;
+
+    // 一個 block：先依序決定區間起點，再各 symbol 平行推進
+    auto flush = [&]() {
+        if (rows == 0) return;
+        const int day0 = st.days;
+        parallelFor((int)st.symbols.size(), [&](int j) {
+            IncSymbol& sym = st.symbols[j];
+            for (int r = 0; r < rows; ++r) {
+                advanceIncSymbol(day0 + r, st.startIdx, sym, block[(size_t)r * C + slot[j]]);
+            }
+        });
+        st.days += rows;
+        added += rows;
+        rows = 0;
+        block.clear();
+    };
+
+    while (true) {
+        long long lineOffset = (long long)fin.tellg();
+        if (!getline(fin, line)) break;
+        bool lastRow = fin.eof();
+        if (lastRow && !partialLastRow) break;  // 沒有換行結尾：這列可能還在寫，下次再讀
+        long long nextOffset = lastRow ? lineOffset + (long long)line.size() : (long long)fin.tellg();
+
+        if (line.find_first_not_of(" \t\r\n") != string::npos
+            && parseDataRow(line, st.headerColumns, cols, date, rowPrices))
+        {
+            int key = parseDateKey(date);
+            if (key > stopAfterKey) {
+                st.fileOffset = lineOffset;
+                break;
+            }
+            if (st.startIdx == -1 && key >= st.fromKey) st.startIdx = st.days + rows;
+
+            block.insert(block.end(), rowPrices.begin(), rowPrices.end());
+            st.lastDate = date;
+            if (++rows == INC_BLOCK_ROWS) flush();
+        }
+        st.fileOffset = nextOffset;
+        if (lastRow) break;
+    }
+    flush();
+    return added;
+}
+
+// --------------------------------------------------
+// 依增量狀態輸出排名（增量 / 串流共用）
+//   區間最後一天 = 最後處理的那天；持股用那天收盤價虛擬平倉（不改狀態）
+// --------------------------------------------------
+bool writeIncRanking(const IncState& st) {
+    ofstream fout("sma_rank_all.csv");
+    if (!fout.is_open()) {
+        cerr << "無法開啟輸出檔案 sma_rank_all.csv\n";
+        return false;
+    }
+    fout << "排名,短期,長期,最終獲利,報酬率,交易次數\n\n";
+
+    int endIdx = st.days - 1;
+    bool first = true;
+    for (const auto& sym : st.symbols) {
+        vector<BruteResult> results;
+        results.reserve(MAXN * MAXN);
+        for (int s = 1; s <= MAXN; s++) {
+            for (int l = 1; l <= MAXN; l++) {
+                const PairState& ps = sym.pairs[(s - 1) * MAXN + (l - 1)];
+                if (st.startIdx >= endIdx) {
+                    results.push_back({ s, l, INITIAL, 0 });
+                    continue;
+                }
+                SimBook<DefaultRules> book = ps.book();   // 複本，不改狀態
+                if (book.qty != 0) book.close(sym.lastPrice, NO_COST);
+                results.push_back({ s, l, book.cash, book.trades });
+            }
+        }
+        BruteResult best = findBest(results);
+        reportAndAppend(results, best, sym.symbol, fout, first, g_opt.topN);
+        first = false;
     }
-    fout << "\n";  // 每檔最後再空一行，視覺上比較像你貼的樣子
+    cout << "\n全部完成，輸出檔：sma_rank_all.csv\n";
+    return true;
+}
 
-    cout << "寫入完成：" << label << "\n";
+// --------------------------------------------------
+// 檢查 checkpoint 是不是用這次的 --symbols、--from 和同一個資料檔 header 建的
+//   回傳不一致的項目，一致就回傳空字串
+// --------------------------------------------------
+string checkIncState(const IncState& st, const string& filename) {
+    if (st.requested != g_opt.symbols) return "--symbols";
+    if (st.fromKey != g_opt.fromKey) return "--from";
+
+    ifstream fin(filename, ios::binary);
+    string line;
+    if (!fin.is_open() || !getline(fin, line) || line != st.header) return "資料檔 header";
+    return "";
 }
 
 // --------------------------------------------------
-// 針對單一 symbol：取出 prices、找 2024 範圍、呼叫 bruteForceAndAppend
+// 增量模式主流程：讀/建 checkpoint → 吃新資料列 → 輸出排名 → 存 checkpoint
 // --------------------------------------------------
-void runForSymbol(
-    const string& symbol,
-    ofstream& fout,
-    bool isFirstSymbol,
-    int topN = 20
-) {
-    int symIdx = findSymbolIndex(symbol);
-    if (symIdx == -1) {
-        cerr << "找不到 symbol: " << symbol << "\n";
-        return;
+int runIncremental() {
+    const string& statePath = g_opt.incrementalPath;
+
+    IncState st;
+    bool buildNew = !ifstream(statePath).good();
+    if (buildNew) {
+        cout << "找不到 checkpoint，從頭建立: " << statePath << "\n";
+    }
+    else if (!loadIncState(st, statePath)) {
+        return 1;
+    }
+    else {
+        string diff = checkIncState(st, g_opt.input);
+        if (!diff.empty()) {
+            cout << "checkpoint 的 " << diff << " 跟這次不一致，從頭重建: " << statePath << "\n";
+            st = IncState();
+            buildNew = true;
+        }
+    }
+    if (buildNew) st.fromKey = g_opt.fromKey;
+
+    auto t0 = chrono::steady_clock::now();
+    int added = consumeNewRows(st, g_opt.input, buildNew);
+    if (added < 0) return 1;
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    cout << "新增天數: " << added << "（共 " << st.days << " 天，最後一天 "
+        << st.lastDate << "，耗時 " << sec << " 秒）\n";
+
+    if (st.startIdx == -1) {
+        cerr << "資料還沒進入模擬區間，暫不輸出排名\n";
     }
+    else if (!writeIncRanking(st)) {
+        return 1;
+    }
+
+    if (!saveIncState(st, statePath)) {
+        cerr << "無法寫入 checkpoint: " << statePath << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// ==================================================
+// 串流模式（--stream）
+//   資料檔大到放不進記憶體（分鐘線、tick 聚合）時用：不建 g_data，
+//   直接用增量模式的逐天推進，一邊讀一邊更新 SMA 滾動總和與每組 (s,l) 的狀態。
+//   常駐的資料只有每檔最近 MAXN 天的價格環 + 65,536 組狀態 + 一個 block 的資料列，
+//   跟檔案長度無關。讀到 --to 之後的日期就停，結果跟批次模式完全一樣。
+// ==================================================
+int runStream() {
+    IncState st;
+    st.fromKey = g_opt.fromKey;
 
+    auto t0 = chrono::steady_clock::now();
+    int added = consumeNewRows(st, g_opt.input, true, g_opt.toKey, true);
+    if (added < 0) return 1;
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    cout << "串流讀取天數: " << added << "（最後一天 " << st.lastDate
+        << "，耗時 " << sec << " 秒）\n";
+
+    if (st.startIdx == -1) {
+        cerr << "找不到區間內的資料\n";
+        return 1;
+    }
+    if (!writeIncRanking(st)) return 1;
+    reportPeakRss();
+    return 0;
+}
+
+// ==================================================
+// Daemon 模式（--serve <socket path>）
+//   g_data 只讀一次；每個 symbol 的 prices + allSMA 第一次查詢時算好就留在
+//   記憶體（--warm 則啟動時全部先算），之後的查詢只需要跑 grid。
+//
+//   協定：一行一個指令，回應也是一行一行（ASCII）
+//     PING                               → PONG
+//     SYMBOLS                            → SYMBOLS AAPL,MSFT,...
+//     RANK <SYMBOL> <from> <to> [topN]   → OK <筆數> <耗時ms>
+//                                          排名,短期,長期,'最終獲利,'報酬率,交易次數
+//                                          ...
+//                                          END
+//     QUIT                               → BYE，關閉這條連線
+//     SHUTDOWN                           → BYE，關閉整個 daemon
+//   錯誤一律回 ERR <訊息>；日期格式同 parseDateKey（1/2/2024、2024-01-02、20240102、2024）
+// ==================================================
+struct WarmSymbol {
     vector<double> prices;
-    vector<string> dates;
-    prices.reserve(g_data.size());
-    dates.reserve(g_data.size());
+    vector<vector<double>> allSMA;
+};
 
-    for (auto& d : g_data) {
-        prices.push_back(d.prices[symIdx]);
-        dates.push_back(d.date);
+map<string, WarmSymbol> g_warm;   // symbol → 常駐的 prices + allSMA
+
+// 取出（必要時先算好）某個 symbol 的常駐資料；找不到 symbol 回傳 nullptr
+const WarmSymbol* getWarmSymbol(const string& symbol) {
+    auto it = g_warm.find(symbol);
+    if (it != g_warm.end()) return &it->second;
+
+    int symIdx = findSymbolIndex(symbol);
+    if (symIdx == -1) return nullptr;
+
+    WarmSymbol w;
+    w.prices = extractPrices(symIdx);
+    w.allSMA = calcAllSMA(w.prices);
+    return &(g_warm[symbol] = std::move(w));
+}
+
+// 處理一行指令，回傳要送回去的文字
+string handleQuery(const string& line, bool& closeConn, bool& shutdown) {
+    stringstream ss(line);
+    string cmd;
+    ss >> cmd;
+    for (auto& c : cmd) c = (char)toupper((unsigned char)c);
+
+    if (cmd == "PING") return "PONG\n";
+    if (cmd == "QUIT") {
+        closeConn = true;
+        return "BYE\n";
+    }
+    if (cmd == "SHUTDOWN") {
+        closeConn = true;
+        shutdown = true;
+        return "BYE\n";
     }
+    if (cmd == "SYMBOLS") {
+        string out = "SYMBOLS ";
+        for (size_t i = 0; i < g_symbols.size(); ++i) {
+            if (i > 0) out += ",";
+            out += g_symbols[i];
+        }
+        return out + "\n";
+    }
+    if (cmd != "RANK") return "ERR unknown command: " + cmd + "\n";
 
-    if (prices.empty()) {
-        cerr << "沒有任何 " << symbol << " 資料\n";
-        return;
+    string symbol, from, to, topStr;
+    if (!(ss >> symbol >> from >> to)) {
+        return "ERR usage: RANK <SYMBOL> <from> <to> [topN]\n";
+    }
+    int topN = 20;
+    if (ss >> topStr) {
+        try { topN = stoi(topStr); }
+        catch (...) { return "ERR bad topN: " + topStr + "\n"; }
+        if (topN < 1) return "ERR bad topN: " + topStr + "\n";
     }
 
-    // 找出「日期字串含 /2024 的起訖 index」
-    int start2024 = -1;
-    int end2024 = -1;
-    for (int i = 0; i < (int)dates.size(); ++i) {
-        if (dates[i].find("/2024") != string::npos) {
-            if (start2024 == -1) start2024 = i;
-            end2024 = i;  // 不斷更新，最後就是最後一筆 2024
+    int fromKey = parseDateKey(from, false);
+    int toKey = parseDateKey(to, true);
+    if (fromKey < 0 || toKey < 0) return "ERR bad date range\n";
+
+    auto t0 = chrono::steady_clock::now();
+
+    const WarmSymbol* w = getWarmSymbol(symbol);
+    if (!w) return "ERR unknown symbol: " + symbol + "\n";
+
+    int startIdx = 0, endIdx = 0;
+    if (!findDateRange(g_dateKeys, fromKey, toKey, startIdx, endIdx)) {
+        return "ERR no data in range\n";
+    }
+
+    vector<BruteResult> results = runGrid(w->prices, w->allSMA, startIdx, endIdx, topN);
+
+    // 只需要前 topN 名：betterResult 是全序，partial_sort 的前段跟完整 sort 一樣
+    int rows = min(topN, (int)results.size());
+    partial_sort(results.begin(), results.begin() + rows, results.end(), betterResult);
+
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+    ostringstream out;
+    out << "OK " << rows << " " << fixed << setprecision(1) << ms << "\n";
+    writeRankRows(out, results, rows);
+    out << "END\n";
+    return out.str();
+}
+
+#ifndef _WIN32
+// 把整段文字寫完（socket 可能一次寫不完）
+bool sendAll(int fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t k = write(fd, data.data() + sent, data.size() - sent);
+        if (k < 0) {
+            if (errno == EINTR) continue;
+            return false;
         }
+        sent += (size_t)k;
     }
+    return true;
+}
 
-    if (start2024 == -1) {
-        cerr << "找不到 2024 的 " << symbol << " 資料\n";
-        return;
+int runServer(const string& path) {
+    // client 中途斷線時 write 會收到 SIGPIPE，忽略掉改用回傳值處理
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "socket 路徑太長: " << path << "\n";
+        return 1;
     }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
 
-    cout << "\n=== Symbol: " << symbol << " ===\n";
-    cout << "2024 起訖 index: " << start2024 << " ~ " << end2024 << "\n";
-    cout << "2024 交易天數: " << (end2024 - start2024 + 1) << "\n";
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        cerr << "建立 socket 失敗: " << strerror(errno) << "\n";
+        return 1;
+    }
+    unlink(path.c_str());  // 上次沒清掉的殘留檔
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 16) < 0) {
+        cerr << "無法綁定 socket " << path << ": " << strerror(errno) << "\n";
+        close(listenFd);
+        return 1;
+    }
+
+    cout << "daemon 啟動，socket: " << path << "\n";
+
+    bool shutdown = false;
+    while (!shutdown) {
+        int conn = accept(listenFd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            cerr << "accept 失敗: " << strerror(errno) << "\n";
+            break;
+        }
+
+        string buf;
+        char chunk[4096];
+        bool closeConn = false;
+        while (!closeConn) {
+            ssize_t k = read(conn, chunk, sizeof(chunk));
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) break;
+            buf.append(chunk, (size_t)k);
+
+            size_t pos;
+            while (!closeConn && (pos = buf.find('\n')) != string::npos) {
+                string line = buf.substr(0, pos);
+                buf.erase(0, pos + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.find_first_not_of(" \t") == string::npos) continue;
+
+                if (!sendAll(conn, handleQuery(line, closeConn, shutdown))) {
+                    closeConn = true;
+                }
+            }
+        }
+        close(conn);
+    }
+
+    close(listenFd);
+    unlink(path.c_str());
+    cout << "daemon 結束\n";
+    return 0;
+}
+#else
+int runServer(const string&) {
+    cerr << "daemon 模式需要 Unix-domain socket，目前只支援 POSIX 平台\n";
+    return 1;
+}
+#endif
+
+// ==================================================
+// 分片執行（--shard i/n [--shard-by hash|cost]）+ 合併（--merge）
+//   很多檔要跑的時候，拆給好幾個行程（可以在不同機器、共用檔案系統），
+//   每個行程只跑自己那一份，寫到 sma_rank_shard_<i>of<n>.csv；
+//   分片檔每一段（包含第一段）都有「SYMBOL,,,,,」標題，合併時才認得出是哪檔。
+//   --merge 把分片檔依 --symbols 的順序重組成跟批次模式一模一樣的 sma_rank_all.csv。
+//
+//   分法只看輸入（symbol 名稱、資料檔、區間），每個行程各自算都會得到同一份分配：
+//   hash：symbol 名稱的 FNV-1a % n（加減 symbol 不會影響其他 symbol 的分片）
+//   cost：估計成本（這檔實際要模擬的天數 × 組合數）由大到小，每次給目前負擔最輕的分片（LPT）；
+//         --gaps drop 時每檔共用同一個日曆、成本都一樣，等於依 --symbols 順序輪流分
+// ==================================================
+string shardOutputPath() {
+    return "sma_rank_shard_" + to_string(g_opt.shardIndex) + "of" + to_string(g_opt.shardCount) + ".csv";
+}
+
+// 估計一檔的計算量；算不出區間的給 0（反正只會印錯誤）
+//   每組 (s,l) 都要走過這檔區間內的每一天，所以看的是「這檔」要模擬幾天（同 applyGapPolicy）：
+//   skip 只剩有價格的日子；ffill 從第一筆價格開始；reset 的缺值日直接跳過，不算
+double estimateSymbolCost(const string& symbol) {
+    int symIdx = findSymbolIndex(symbol);
+    if (symIdx < 0) return 0.0;
+    int startIdx = 0, endIdx = 0;
+    if (!findDateRange(g_dateKeys, g_opt.fromKey, g_opt.toKey, startIdx, endIdx)) return 0.0;
+
+    int days = endIdx - startIdx + 1;
+    if (g_opt.gaps != GapPolicy::Drop) {
+        const auto& mask = g_valid[symIdx];
+        if (g_opt.gaps == GapPolicy::FFill) {
+            int lead = nextMaskBit(mask, (int)g_data.size(), 0, true);
+            days = max(endIdx - max(startIdx, lead) + 1, 0);
+        }
+        else {
+            days = countValidBefore(mask, endIdx + 1) - countValidBefore(mask, startIdx);
+        }
+    }
+    return (double)days * MAXN * MAXN;
+}
+
+// 回傳這個分片要跑的 symbol（保持 --symbols 原本的相對順序）
+vector<string> selectShardSymbols(const vector<string>& symbols) {
+    const int n = g_opt.shardCount;
+    vector<int> owner(symbols.size(), 0);
+
+    if (g_opt.shardByCost) {
+        vector<int> order(symbols.size());
+        vector<double> cost(symbols.size());
+        for (size_t j = 0; j < symbols.size(); ++j) {
+            order[j] = (int)j;
+            cost[j] = estimateSymbolCost(symbols[j]);
+        }
+        // 成本大的先分；同成本依原順序，確保每個行程排出來都一樣
+        stable_sort(order.begin(), order.end(), [&](int a, int b) { return cost[a] > cost[b]; });
+
+        vector<double> load(n, 0.0);
+        for (int j : order) {
+            int best = (int)(min_element(load.begin(), load.end()) - load.begin());
+            owner[j] = best;
+            load[best] += cost[j];
+        }
+    }
+    else {
+        for (size_t j = 0; j < symbols.size(); ++j) {
+            Fnv64 h;
+            h.add(symbols[j]);
+            owner[j] = (int)(h.h % (unsigned long long)n);
+        }
+    }
+
+    vector<string> mine;
+    for (size_t j = 0; j < symbols.size(); ++j) {
+        if (owner[j] == g_opt.shardIndex - 1) mine.push_back(symbols[j]);
+    }
+    return mine;
+}
+
+// 讀一個分片檔：symbol → 該段的排名列（不含標題與空行）
+bool readShardSections(const string& path, map<string, vector<string>>& sections) {
+    ifstream fin(path);
+    if (!fin.is_open()) {
+        cerr << "無法開啟分片檔: " << path << "\n";
+        return false;
+    }
+
+    string line;
+    if (!getline(fin, line)) {
+        cerr << "分片檔是空的: " << path << "\n";
+        return false;
+    }
+    if (line.size() >= 3 && line.compare(0, 3, "\xEF\xBB\xBF") == 0) line.erase(0, 3);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line != rankHeader()) {
+        cerr << "不是排名檔（第一行不對）: " << path << "\n";
+        return false;
+    }
 
-    bruteForceAndAppend(
-        prices,
-        start2024,
-        end2024,
-        symbol,
-        fout,
-        isFirstSymbol,
-        topN
-    );
+    const string labelTail = ",,,,,";
+    vector<string>* cur = nullptr;
+    while (getline(fin, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+
+        if (line.size() > labelTail.size()
+            && line.compare(line.size() - labelTail.size(), labelTail.size(), labelTail) == 0) {
+            string symbol = line.substr(0, line.size() - labelTail.size());
+            if (sections.count(symbol)) {
+                cerr << "symbol " << symbol << " 在多個分片裡都有: " << path << "\n";
+                return false;
+            }
+            cur = &sections[symbol];
+            continue;
+        }
+        if (!cur) {
+            cerr << "第一段沒有 symbol 標題（不是分片輸出？）: " << path << "\n";
+            return false;
+        }
+        cur->push_back(line);
+    }
+    return true;
+}
+
+int runMerge() {
+    map<string, vector<string>> sections;
+    for (const auto& path : g_opt.mergeFiles) {
+        if (!readShardSections(path, sections)) return 1;
+    }
+
+    // 順序：先照 --symbols，分片裡多出來的 symbol 依名稱接在後面
+    vector<string> order;
+    for (const auto& sym : g_opt.symbols) {
+        if (sections.count(sym)) order.push_back(sym);
+        else cerr << "分片裡找不到 symbol: " << sym << "\n";
+    }
+    for (const auto& kv : sections) {
+        if (find(g_opt.symbols.begin(), g_opt.symbols.end(), kv.first) == g_opt.symbols.end()) {
+            order.push_back(kv.first);
+        }
+    }
+
+    ofstream fout("sma_rank_all.csv");
+    if (!fout.is_open()) {
+        cerr << "無法開啟輸出檔案 sma_rank_all.csv\n";
+        return 1;
+    }
+
+    // 跟 reportAndAppend 同樣的分段格式：第一段不加標題
+    fout << rankHeader() << "\n\n";
+    for (size_t j = 0; j < order.size(); ++j) {
+        if (j > 0) fout << order[j] << ",,,,,\n\n";
+        for (const auto& row : sections[order[j]]) fout << row << "\n";
+        fout << "\n";
+    }
+
+    fout.close();
+    cout << "合併 " << g_opt.mergeFiles.size() << " 個分片、" << order.size()
+        << " 檔 → sma_rank_all.csv\n";
+    return 0;
+}
+
+bool parseSortKey(const string& v, SortKey& key) {
+    if (v == "capital") key = SortKey::Capital;
+    else if (v == "drawdown") key = SortKey::Drawdown;
+    else if (v == "sharpe") key = SortKey::Sharpe;
+    else if (v == "exposure") key = SortKey::Exposure;
+    else if (v == "winrate") key = SortKey::WinRate;
+    else if (v == "trades") key = SortKey::Trades;
+    else return false;
+    return true;
+}
+
+// --------------------------------------------------
+// 解析命令列參數 → g_opt
+//   --input <file>          資料檔（預設 multistocks.csv）
+//   --input-dir <dir>       改讀目錄：每檔 symbol 一個 <SYMBOL>.csv（Date,Close）
+//   --indicator sma|ema|wma 均線種類（預設 sma）
+//   --fill close|next       訊號當天 / 隔天收盤成交（預設 close）
+//   --fractional            可買零股
+//   --long-short            死亡交叉時放空、黃金交叉時回補
+//   --fee RATE              每筆成交收成交金額 RATE 比例的手續費
+//   --fixed-fee X           每筆成交另收固定 X 元
+//   --slippage RATE         買進價 * (1 + RATE)、賣出價 * (1 - RATE)
+//   --costs f:r:s,...       另外評估的成本情境（固定:比例:滑價），跟主排名共用同一次 grid
+//   --metrics               另外算最大回撤 / Sharpe / 持有比例 / 勝率，排名多四欄
+//   --sort capital|drawdown|sharpe|exposure|winrate|trades   排名依據（需要的話自動開 --metrics）
+//   --pareto [k1,k2[,k3]]   另外輸出這 2 ~ 3 個目標的 Pareto front（預設 capital,drawdown,trades）
+//   --symbols A,B,C         要跑的 symbol（預設 AAPL,MMM,KO,V,CAT）
+//   --year Y                模擬區間 = 整年（預設 2024）
+//   --from <date>           模擬區間起點（日期格式同 parseDateKey）
+//   --to <date>             模擬區間終點
+//   --top N                 每檔輸出前幾名（預設 20）
+//   --serve <socket>        daemon 模式
+//   --warm                  daemon 啟動時先把所有 symbol 的 SMA 算好
+//   --incremental <state>   增量更新模式（區間從 --from 到最新一天）
+//   --cache-dir <dir>       結果快取目錄
+//   --threads N             平行 thread 數（預設全部核心）
+//   --walk-forward          walk-forward 模式（--train-months / --test-months，預設 12 / 1）
+//   --years 2014-2024       多區間模式（也可以用逗號列出年份）
+//   --engine scan|dedupe|bnb|tiled|batched  grid 的實作方式（結果相同；dedupe 單一情境時改用 scan）
+//   --bench                 比較各 engine / 分塊大小的速度與 cache miss
+//   --screen s,l            同一組 (s,l) 套到所有 symbol（全市場篩選）
+//   --mem-budget MB         平行工作的記憶體預算
+//   --shard i/n             只跑第 i 份（--shard-by hash|cost，預設 hash）
+//   --merge f1 f2 ...       把分片輸出合併成 sma_rank_all.csv（順序照 --symbols）
+//   --coordinate <dir>      檔案佇列 coordinator（walk-forward；--spawn / --retries / --lease-sec）
+//   --worker <dir>          從檔案佇列領工作
+//   --checkpoint <dir>      批次模式的 checkpoint（--checkpoint-rows N，預設每 32 個 s）
+//   --resume                從 checkpoint 接著跑
+//   --stream                串流模式：邊讀邊算，記憶體跟檔案長度無關
+//   --gaps drop|skip|ffill|reset  缺值處理（預設 drop：整天略過；其他只支援批次模式）
+// --------------------------------------------------
+bool parseArgs(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+
+        if (arg == "--input" && hasValue) g_opt.input = argv[++i];
+        else if (arg == "--serve" && hasValue) g_opt.servePath = argv[++i];
+        else if (arg == "--warm") g_opt.warmAll = true;
+        else if (arg == "--incremental" && hasValue) g_opt.incrementalPath = argv[++i];
+        else if (arg == "--cache-dir" && hasValue) g_opt.cacheDir = argv[++i];
+        else if (arg == "--threads" && hasValue) g_opt.threads = atoi(argv[++i]);
+        else if (arg == "--walk-forward") g_opt.walkForward = true;
+        else if (arg == "--engine" && hasValue) {
+            string v = argv[++i];
+            if (v == "scan") g_opt.engine = GridEngine::Scan;
+            else if (v == "dedupe") g_opt.engine = GridEngine::Dedupe;
+            else if (v == "bnb") g_opt.engine = GridEngine::BnB;
+            else if (v == "tiled") g_opt.engine = GridEngine::Tiled;
+            else if (v == "batched") g_opt.engine = GridEngine::Batched;
+            else {
+                cerr << "未知的 engine: " << v << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--bench") g_opt.bench = true;
+        else if (arg == "--mem-budget" && hasValue) g_opt.memBudgetMB = atoi(argv[++i]);
+        else if (arg == "--shard" && hasValue) {
+            string v = argv[++i];
+            if (sscanf(v.c_str(), "%d/%d", &g_opt.shardIndex, &g_opt.shardCount) != 2
+                || g_opt.shardCount < 1 || g_opt.shardIndex < 1 || g_opt.shardIndex > g_opt.shardCount) {
+                cerr << "--shard 格式：i/n（1 <= i <= n）\n";
+                return false;
+            }
+        }
+        else if (arg == "--shard-by" && hasValue) {
+            string v = argv[++i];
+            if (v == "hash") g_opt.shardByCost = false;
+            else if (v == "cost") g_opt.shardByCost = true;
+            else {
+                cerr << "--shard-by 只能是 hash 或 cost\n";
+                return false;
+            }
+        }
+        else if (arg == "--checkpoint" && hasValue) g_opt.checkpointDir = argv[++i];
+        else if (arg == "--checkpoint-rows" && hasValue) {
+            g_opt.checkpointRows = atoi(argv[++i]);
+            if (g_opt.checkpointRows < 1) {
+                cerr << "--checkpoint-rows 必須 >= 1\n";
+                return false;
+            }
+        }
+        else if (arg == "--resume") g_opt.resume = true;
+        else if (arg == "--stream") g_opt.stream = true;
+        else if (arg == "--input-dir" && hasValue) g_opt.inputDir = argv[++i];
+        else if (arg == "--fill" && hasValue) {
+            string v = argv[++i];
+            if (v == "close") g_opt.fillNextDay = false;
+            else if (v == "next") g_opt.fillNextDay = true;
+            else {
+                cerr << "--fill 只能是 close / next\n";
+                return false;
+            }
+        }
+        else if (arg == "--fractional") g_opt.fractional = true;
+        else if (arg == "--metrics") g_opt.metrics = true;
+        else if (arg == "--sort" && hasValue) {
+            if (!parseSortKey(argv[++i], g_opt.sortKey)) {
+                cerr << "--sort 只能是 capital / drawdown / sharpe / exposure / winrate / trades\n";
+                return false;
+            }
+            if (g_opt.sortKey != SortKey::Capital && g_opt.sortKey != SortKey::Trades) g_opt.metrics = true;
+        }
+        else if (arg == "--pareto") {
+            // 目標可省略（預設 capital,drawdown,trades）
+            string v = (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) ? argv[++i] : "capital,drawdown,trades";
+            g_opt.paretoKeys.clear();
+            for (const auto& part : splitCsvLine(v)) {
+                SortKey k;
+                if (!parseSortKey(part, k) || find(g_opt.paretoKeys.begin(), g_opt.paretoKeys.end(), k) != g_opt.paretoKeys.end()) {
+                    cerr << "--pareto 的目標不合法或重複: " << part << "\n";
+                    return false;
+                }
+                g_opt.paretoKeys.push_back(k);
+            }
+            if (g_opt.paretoKeys.size() < 2 || g_opt.paretoKeys.size() > 3) {
+                cerr << "--pareto 需要 2 ~ 3 個目標\n";
+                return false;
+            }
+            g_opt.metrics = true;
+        }
+        else if (arg == "--long-short") g_opt.longShort = true;
+        else if ((arg == "--fee" || arg == "--fixed-fee" || arg == "--slippage") && hasValue) {
+            string v = argv[++i];
+            char* endp = nullptr;
+            double x = strtod(v.c_str(), &endp);
+            bool isFixed = (arg == "--fixed-fee");
+            if (endp == v.c_str() || *endp != '\0' || !(x >= 0 && (isFixed || x < 1))) {
+                cerr << arg << (isFixed ? " 必須 >= 0\n" : " 必須是 0 ~ 1 之間的比例（例如 0.001）\n");
+                return false;
+            }
+            (arg == "--fee" ? g_opt.cost.rate : isFixed ? g_opt.cost.fixed : g_opt.cost.slip) = x;
+        }
+        else if (arg == "--costs" && hasValue) {
+            g_opt.costScenarios.clear();
+            for (const auto& part : splitCsvLine(argv[++i])) {
+                TradeCost c;
+                char extra = 0;
+                if (sscanf(part.c_str(), "%lf:%lf:%lf%c", &c.fixed, &c.rate, &c.slip, &extra) != 3
+                    || !(c.fixed >= 0) || !(c.rate >= 0 && c.rate < 1) || !(c.slip >= 0 && c.slip < 1)) {
+                    cerr << "--costs 格式：fixed:fee:slip[,fixed:fee:slip...]，錯誤的情境: " << part << "\n";
+                    return false;
+                }
+                g_opt.costScenarios.push_back(c);
+            }
+            if (g_opt.costScenarios.empty() || g_opt.costScenarios.size() > 16) {
+                cerr << "--costs 需要 1 ~ 16 個情境\n";
+                return false;
+            }
+        }
+        else if (arg == "--indicator" && hasValue) {
+            string v = argv[++i];
+            if (v == "sma") g_opt.indicator = Indicator::SMA;
+            else if (v == "ema") g_opt.indicator = Indicator::EMA;
+            else if (v == "wma") g_opt.indicator = Indicator::WMA;
+            else {
+                cerr << "--indicator 只能是 sma / ema / wma\n";
+                return false;
+            }
+        }
+        else if (arg == "--gaps" && hasValue) {
+            string v = argv[++i];
+            if (v == "drop") g_opt.gaps = GapPolicy::Drop;
+            else if (v == "skip") g_opt.gaps = GapPolicy::Skip;
+            else if (v == "ffill") g_opt.gaps = GapPolicy::FFill;
+            else if (v == "reset") g_opt.gaps = GapPolicy::Reset;
+            else {
+                cerr << "--gaps 只能是 drop / skip / ffill / reset\n";
+                return false;
+            }
+        }
+        else if (arg == "--coordinate" && hasValue) g_opt.coordinateDir = argv[++i];
+        else if (arg == "--worker" && hasValue) g_opt.workerDir = argv[++i];
+        else if ((arg == "--spawn" || arg == "--retries" || arg == "--lease-sec") && hasValue) {
+            int v = atoi(argv[++i]);
+            if (v < (arg == "--lease-sec" ? 1 : 0)) {
+                cerr << arg << " 的值不合法\n";
+                return false;
+            }
+            (arg == "--spawn" ? g_opt.spawnWorkers : arg == "--retries" ? g_opt.retries : g_opt.leaseSec) = v;
+        }
+        else if (arg == "--merge" && hasValue) {
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                g_opt.mergeFiles.push_back(argv[++i]);
+            }
+        }
+        else if (arg == "--screen" && hasValue) {
+            string v = argv[++i];
+            if (sscanf(v.c_str(), "%d,%d", &g_opt.screenS, &g_opt.screenL) != 2
+                || g_opt.screenS < 1 || g_opt.screenS > MAXN
+                || g_opt.screenL < 1 || g_opt.screenL > MAXN) {
+                cerr << "--screen 格式：s,l（1.." << MAXN << "）\n";
+                return false;
+            }
+        }
+        else if (arg == "--years" && hasValue) {
+            g_opt.years.clear();
+            for (const auto& part : splitCsvLine(argv[++i])) {
+                int a = 0, b = 0;
+                int n = sscanf(part.c_str(), "%d-%d", &a, &b);
+                if (n == 1) b = a;
+                if (n < 1 || a > b) {
+                    cerr << "年份格式錯誤: " << part << "\n";
+                    return false;
+                }
+                for (int y = a; y <= b; ++y) g_opt.years.push_back(y);
+            }
+            if (g_opt.years.empty() || g_opt.years.size() > 64) {
+                cerr << "--years 需要 1 ~ 64 個年份\n";
+                return false;
+            }
+        }
+        else if ((arg == "--train-months" || arg == "--test-months") && hasValue) {
+            int v = atoi(argv[++i]);
+            if (v < 1) {
+                cerr << arg << " 必須 >= 1\n";
+                return false;
+            }
+            (arg == "--train-months" ? g_opt.trainMonths : g_opt.testMonths) = v;
+        }
+        else if (arg == "--symbols" && hasValue) {
+            g_opt.symbols.clear();
+            for (const auto& sym : splitCsvLine(argv[++i])) {
+                if (!sym.empty()) g_opt.symbols.push_back(sym);
+            }
+        }
+        else if ((arg == "--year" || arg == "--from" || arg == "--to") && hasValue) {
+            string v = argv[++i];
+            int fromKey = parseDateKey(v, false);
+            int toKey = parseDateKey(v, true);
+            if (fromKey < 0) {
+                cerr << "日期格式錯誤: " << v << "\n";
+                return false;
+            }
+            if (arg != "--to") g_opt.fromKey = fromKey;
+            if (arg != "--from") g_opt.toKey = toKey;
+        }
+        else if (arg == "--top" && hasValue) {
+            g_opt.topN = atoi(argv[++i]);
+            if (g_opt.topN < 1) {
+                cerr << "--top 必須 >= 1\n";
+                return false;
+            }
+        }
+        else {
+            cerr << "未知或不完整的參數: " << arg << "\n";
+            return false;
+        }
+    }
+    if (g_opt.gaps != GapPolicy::Drop
+        && (!g_opt.incrementalPath.empty() || g_opt.stream || !g_opt.servePath.empty() || g_opt.bench
+            || g_opt.screenS > 0 || g_opt.walkForward || !g_opt.years.empty()
+            || !g_opt.coordinateDir.empty() || !g_opt.workerDir.empty())) {
+        cerr << "--gaps " << gapPolicyName(g_opt.gaps) << " 目前只支援批次模式（可搭配 --shard / --checkpoint）\n";
+        return false;
+    }
+    if (g_opt.indicator != Indicator::SMA
+        && (!g_opt.incrementalPath.empty() || g_opt.stream || g_opt.screenS > 0)) {
+        cerr << "--indicator " << indicatorName(g_opt.indicator)
+            << " 不支援 --incremental / --stream / --screen（這些模式用 SMA 專用的滾動總和）\n";
+        return false;
+    }
+    if (customRules()
+        && (!g_opt.incrementalPath.empty() || g_opt.stream || g_opt.bench || g_opt.screenS > 0
+            || !g_opt.years.empty()
+            || g_opt.engine == GridEngine::Tiled || g_opt.engine == GridEngine::Batched)) {
+        cerr << "--fill next / --fractional / --long-short / 交易成本 / --metrics 只支援 --engine scan / dedupe / bnb（bnb 不剪枝）"
+            << "（不能搭配 --incremental / --stream / --bench / --screen / --years）\n";
+        return false;
+    }
+    if (!g_opt.paretoKeys.empty()
+        && (!g_opt.servePath.empty() || g_opt.walkForward || !g_opt.coordinateDir.empty() || !g_opt.workerDir.empty()
+            || g_opt.shardCount > 0 || !g_opt.cacheDir.empty() || !g_opt.checkpointDir.empty())) {
+        cerr << "--pareto 目前只支援批次模式（不能搭配 --shard / --cache-dir / --checkpoint）\n";
+        return false;
+    }
+    if (!g_opt.costScenarios.empty()
+        && (!g_opt.incrementalPath.empty() || g_opt.stream || !g_opt.servePath.empty() || g_opt.bench
+            || g_opt.screenS > 0 || g_opt.walkForward || !g_opt.years.empty()
+            || !g_opt.coordinateDir.empty() || !g_opt.workerDir.empty() || g_opt.shardCount > 0
+            || !g_opt.cacheDir.empty() || !g_opt.checkpointDir.empty())) {
+        cerr << "--costs 目前只支援批次模式（不能搭配 --shard / --cache-dir / --checkpoint）\n";
+        return false;
+    }
+    if (!g_opt.inputDir.empty() && (!g_opt.incrementalPath.empty() || g_opt.stream)) {
+        cerr << "--input-dir 不能搭配 --incremental / --stream（這兩個模式直接讀單一資料檔）\n";
+        return false;
+    }
+    if (g_opt.resume && g_opt.checkpointDir.empty()) {
+        cerr << "--resume 需要搭配 --checkpoint <dir>\n";
+        return false;
+    }
+    if (g_opt.engine == GridEngine::Dedupe) {
+        // 抽事件本身就要把每組的區間掃一遍，只模擬一個情境時雜湊/比對是純粹多出來的
+        // （實測比 scan 慢 20~50%，區間越長、開 --metrics 越明顯）；只有 --costs 多個情境
+        // 共用同一次抽取才划算，而 --costs 不管 --engine 都會用事件去重
+        cout << "--engine dedupe 只在 --costs 多個成本情境時划算（--costs 會自動使用），這次改用 scan\n";
+        g_opt.engine = GridEngine::Scan;
+    }
+    return true;
 }
 
 // --------------------------------------------------
 // main：讀檔 → 針對 AAPL, MMM, KO, V, CAT 各跑一次
 //   輸出到同一個 sma_rank_all.csv，用你貼的那種分段格式
+//   加 --serve 則改成常駐 daemon 模式
 // --------------------------------------------------
-int main() {
-    string filename = "multistocks.csv";
+int main(int argc, char* argv[]) {
+    if (!parseArgs(argc, argv)) {
+        return 1;
+    }
+    initSimKernels();
+
+    if (!g_opt.incrementalPath.empty()) {
+        return runIncremental();
+    }
+
+    if (g_opt.stream) {
+        return runStream();
+    }
+
+    if (!g_opt.mergeFiles.empty()) {
+        return runMerge();
+    }
+
+    string filename = g_opt.input;
 
-    if (!loadFile(filename)) {
+    // 只用到 --symbols 的模式就只解析那幾欄；daemon（任意查詢）、全市場篩選、
+    // 佇列（worker 要跟 coordinator 比對整份資料的指紋）需要所有欄位
+    bool needAllColumns = !g_opt.servePath.empty() || g_opt.screenS > 0
+        || !g_opt.coordinateDir.empty() || !g_opt.workerDir.empty();
+
+    vector<string> projection = needAllColumns ? vector<string>() : g_opt.symbols;
+    bool loaded = g_opt.inputDir.empty() ? loadFile(filename, projection)
+        : loadDirectory(g_opt.inputDir, projection);
+    if (!loaded) {
         return 1;
     }
 
     cout << "股票數量: " << g_symbols.size() << "\n";
     cout << "總天數: " << g_data.size() << "\n";
+    if (g_opt.gaps != GapPolicy::Drop) {
+        cout << "缺值格數: " << buildValidMasks() << "（--gaps " << gapPolicyName(g_opt.gaps) << "）\n";
+    }
 
-    // 想要輸出的 symbol 列表
-    // 如果只要 AAPL, MMM, KO, V，就把 "CAT" 拿掉就好
-    vector <string> targetSymbols = { "AAPL", "MMM", "KO", "V", "CAT" };
+    if (!g_opt.servePath.empty()) {
+        if (g_opt.warmAll) {
+            for (const auto& sym : g_symbols) getWarmSymbol(sym);
+            cout << "已預先計算 " << g_warm.size() << " 檔 SMA\n";
+        }
+        return runServer(g_opt.servePath);
+    }
 
-    ofstream fout("sma_rank_all.csv");
+    if (g_opt.bench) {
+        return runBenchmark();
+    }
+
+    if (g_opt.screenS > 0) {
+        return runScreen();
+    }
+
+    if (!g_opt.coordinateDir.empty()) {
+        return runCoordinator(g_opt.coordinateDir);
+    }
+
+    if (!g_opt.workerDir.empty()) {
+        return runWorker(g_opt.workerDir);
+    }
+
+    if (g_opt.walkForward) {
+        return runWalkForward();
+    }
+
+    if (!g_opt.years.empty()) {
+        return runMultiRange();
+    }
+
+    // 想要輸出的 symbol 列表（預設 AAPL, MMM, KO, V, CAT，可用 --symbols 指定）
+    // 分片時只留這一份的 symbol，每段都加標題，之後用 --merge 合併
+    const bool sharded = g_opt.shardCount > 0;
+    const vector<string> targetSymbols = sharded ? selectShardSymbols(g_opt.symbols) : g_opt.symbols;
+    const string outPath = sharded ? shardOutputPath() : "sma_rank_all.csv";
+    if (sharded) {
+        cout << "分片 " << g_opt.shardIndex << "/" << g_opt.shardCount
+            << (g_opt.shardByCost ? "（依成本）" : "（依 hash）") << "：" << targetSymbols.size() << " 檔\n";
+    }
+
+    ofstream fout(outPath);
     if (!fout.is_open()) {
-        cerr << "無法開啟輸出檔案 sma_rank_all.csv\n";
+        cerr << "無法開啟輸出檔案 " << outPath << "\n";
         return 1;
     }
 
     // 第一行欄位名稱（只寫一次）
-    fout << "排名,短期,長期,最終獲利,報酬率,交易次數\n\n";
+    fout << rankHeader() << "\n\n";
 
-    bool first = true;
-    for (const auto& sym : targetSymbols) {
-        runForSymbol(sym, fout, first, 20);
-        first = false;
+    // 各檔平行計算（每個 worker 用自己的 arena；同時幾個看記憶體預算），
+    // 再依原本順序寫出
+    vector<SymbolRank> ranks(targetSymbols.size());
+    for (auto& r : ranks) r.top.reserve(g_opt.topN);
+    int workers = admittedWorkers(estimateTaskBytes());
+    ensureArenas(min(workers, max((int)targetSymbols.size(), 1)));
+
+    parallelForWorker((int)targetSymbols.size(), [&](int j, int worker) {
+        rankSymbol(targetSymbols[j], *g_arenas[worker], g_opt.topN, ranks[j]);
+    }, workers);
+
+    for (size_t j = 0; j < targetSymbols.size(); ++j) {
+        emitSymbolRank(targetSymbols[j], ranks[j], fout, j == 0 && !sharded, g_opt.topN);
     }
+    printArenaStats();
+    reportPeakRss();
 
     fout.close();
-    cout << "\n全部完成，輸出檔：sma_rank_all.csv\n";
+    cout << "\n全部完成，輸出檔：" << outPath << "\n";
     return 0;
 }